@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "Compress.h"
+
+namespace android {
+namespace gtest_extras {
+
+// The shortest match that is encoded, anything shorter stays a literal.
+constexpr size_t kMinMatch = 4;
+
+// The hash table holds the last position of every hashed 4 byte sequence,
+// 4096 entries of 32 bits, so 16 KB for every compressed block.
+constexpr size_t kHashBits = 12;
+
+static uint32_t Load32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static void PutVarint(size_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static bool GetVarint(const char** data, const char* end, size_t* value) {
+  *value = 0;
+  for (size_t shift = 0; *data < end && shift < 64; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*data)++);
+    *value |= static_cast<size_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void PutUint32(uint32_t value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void CompressBlock(const char* data, size_t size, std::string* out) {
+  CHECK_LE(size, kCompressBlockSize);
+  // Positions are stored plus one, so that zero means no entry.
+  std::vector<uint32_t> table(1 << kHashBits);
+  size_t pos = 0;
+  size_t literal_start = 0;
+  while (pos + kMinMatch <= size) {
+    uint32_t sequence = Load32(&data[pos]);
+    uint32_t hash = (sequence * 2654435761U) >> (32 - kHashBits);
+    size_t candidate = table[hash];
+    table[hash] = pos + 1;
+    if (candidate == 0 || Load32(&data[candidate - 1]) != sequence) {
+      pos++;
+      continue;
+    }
+    size_t match = candidate - 1;
+    size_t length = kMinMatch;
+    while (pos + length < size && data[match + length] == data[pos + length]) {
+      length++;
+    }
+
+    PutVarint(pos - literal_start, out);
+    out->append(&data[literal_start], pos - literal_start);
+    uint16_t offset = pos - match;
+    out->push_back(static_cast<char>(offset & 0xff));
+    out->push_back(static_cast<char>(offset >> 8));
+    PutVarint(length - kMinMatch, out);
+    pos += length;
+    literal_start = pos;
+  }
+  PutVarint(size - literal_start, out);
+  out->append(&data[literal_start], size - literal_start);
+}
+
+bool DecompressBlock(const char* data, size_t data_size, char* out, size_t size) {
+  const char* end = data + data_size;
+  size_t pos = 0;
+  while (true) {
+    size_t literals;
+    if (!GetVarint(&data, end, &literals) || literals > static_cast<size_t>(end - data) ||
+        literals > size - pos) {
+      return false;
+    }
+    memcpy(&out[pos], data, literals);
+    data += literals;
+    pos += literals;
+    if (pos == size) {
+      return data == end;
+    }
+
+    if (end - data < 2) {
+      return false;
+    }
+    size_t offset = static_cast<uint8_t>(data[0]) | (static_cast<uint8_t>(data[1]) << 8);
+    data += 2;
+    size_t length;
+    if (!GetVarint(&data, end, &length) || offset == 0 || offset > pos ||
+        size - pos < kMinMatch || length > size - pos - kMinMatch) {
+      return false;
+    }
+    length += kMinMatch;
+    // The match can overlap the bytes it produces, so copy byte by byte.
+    for (size_t i = 0; i < length; i++, pos++) {
+      out[pos] = out[pos - offset];
+    }
+  }
+}
+
+CompressedOutput::CompressedOutput(const char* data, size_t size) : size_(size) {
+  std::string block;
+  for (size_t offset = 0; offset < size; offset += kCompressBlockSize) {
+    size_t block_size = std::min(kCompressBlockSize, size - offset);
+    block.clear();
+    CompressBlock(&data[offset], block_size, &block);
+    PutUint32(block_size, &blocks_);
+    if (block.size() < block_size) {
+      PutUint32(block.size(), &blocks_);
+      blocks_ += block;
+    } else {
+      PutUint32(block_size, &blocks_);
+      blocks_.append(&data[offset], block_size);
+    }
+  }
+  blocks_.shrink_to_fit();
+}
+
+void CompressedOutput::Read(const std::function<void(const char*, size_t)>& fn) const {
+  std::string buffer;
+  const char* data = blocks_.data();
+  const char* end = data + blocks_.size();
+  while (data < end) {
+    uint32_t size = Load32(data);
+    uint32_t stored_size = Load32(data + sizeof(uint32_t));
+    data += 2 * sizeof(uint32_t);
+    if (stored_size == size) {
+      fn(data, size);
+    } else {
+      buffer.resize(size);
+      if (!DecompressBlock(data, stored_size, &buffer[0], size)) {
+        LOG(FATAL) << "Compressed output is not valid.";
+      }
+      fn(buffer.data(), size);
+    }
+    data += stored_size;
+  }
+}
+
+}  // namespace gtest_extras
+}  // namespace android
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+
+namespace android {
+namespace gtest_extras {
+
+constexpr size_t kCompressBlockSize = 65536;
+
+// Compresses a block of at most kCompressBlockSize bytes with a small LZ77
+// codec, appending the result to out. Test output is mostly text with many
+// repeated lines, which this handles well without any dependencies.
+//
+// The compressed block is a sequence of a varint literal length, the
+// literals, a 16 bit little endian offset and a varint match length minus
+// 4, the shortest match. The last sequence only has literals.
+void CompressBlock(const char* data, size_t size, std::string* out);
+
+// Decompresses a block made by CompressBlock into out, which must have room
+// for exactly size bytes. Returns false if the block is not valid.
+bool DecompressBlock(const char* data, size_t data_size, char* out, size_t size);
+
+// Output stored compressed in independent blocks, so that it can be read
+// back one block at a time.
+class CompressedOutput {
+ public:
+  CompressedOutput(const char* data, size_t size);
+
+  // Calls fn with the output one block at a time.
+  void Read(const std::function<void(const char*, size_t)>& fn) const;
+
+  size_t size() const { return size_; }
+  size_t compressed_size() const { return blocks_.size(); }
+
+ private:
+  // Every block starts with its size and its stored size, both 32 bit. A
+  // block that does not get smaller is stored as is, with both sizes equal.
+  std::string blocks_;
+  size_t size_;
+};
+
+}  // namespace gtest_extras
+}  // namespace android
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -21,14 +22,36 @@
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
+
+#include <algorithm>
 #include <atomic>
+#include <numeric>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__linux__)
+#include <android-base/cmsg.h>
+#endif
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
@@ -37,12 +60,65 @@
 #include "Isolate.h"
 #include "NanoTime.h"
 #include "Test.h"
+#include "XmlWriter.h"
 
 namespace android {
 namespace gtest_extras {
 
 static std::atomic_int g_signal;
 
+#if defined(__linux__)
+// The signals that are blocked and read from the signalfd instead of being
+// delivered to a handler.
+static sigset_t g_blocked_signals;
+
+enum EventType : uint32_t {
+  EVENT_OUTPUT = 0,
+  EVENT_EXIT,
+  EVENT_TIMER,
+  EVENT_SIGNAL,
+  EVENT_CONTROL,
+  EVENT_LISTING,
+};
+
+static int PidfdOpen(pid_t pid) {
+#if defined(__NR_pidfd_open)
+  return syscall(__NR_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void EpollAdd(int epoll_fd, int fd, EventType type, size_t index) {
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = (static_cast<uint64_t>(type) << 32) | index;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    PLOG(FATAL) << "Unexpected failure from epoll_ctl";
+  }
+}
+
+static void EpollDel(int epoll_fd, int fd) {
+  // The fd must be removed explicitly since forked children hold copies of
+  // it, which would keep the registration alive after the close.
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+    PLOG(FATAL) << "Unexpected failure from epoll_ctl";
+  }
+}
+
+static void RegisterSignalHandler() {
+  if (sigprocmask(SIG_BLOCK, &g_blocked_signals, nullptr) == -1) {
+    PLOG(FATAL) << "Blocking signals failed";
+  }
+}
+
+static void UnregisterSignalHandler() {
+  if (sigprocmask(SIG_UNBLOCK, &g_blocked_signals, nullptr) == -1) {
+    PLOG(FATAL) << "Unblocking signals failed";
+  }
+}
+#else
 static void SignalHandler(int sig) {
   g_signal = sig;
 }
@@ -68,6 +144,66 @@ static void UnregisterSignalHandler() {
     PLOG(FATAL) << "Disabling SIGQUIT handler failed";
   }
 }
+#endif
+
+// How long a reading of the memory state is used before reading it again.
+static constexpr uint64_t kMemoryCheckIntervalNs = 100 * kNsPerMs;
+
+// The size of the output pipes, larger than the default so that tests that
+// write a lot block less often. It is kept well below the default limit on
+// the total size of the pipes of a user, even with many jobs.
+static constexpr int kPipeSize = 256 * 1024;
+
+// Returns the percentage of time some tasks stalled on memory over the last
+// 10 seconds, or 0 if the kernel does not report it.
+static double ReadMemoryPressure() {
+  std::string content;
+  double avg10;
+  if (!android::base::ReadFileToString("/proc/pressure/memory", &content) ||
+      sscanf(content.c_str(), "some avg10=%lf", &avg10) != 1) {
+    return 0;
+  }
+  return avg10;
+}
+
+// Returns the number after the first line starting with prefix in a file
+// like /proc/meminfo, or default_value if there is no such line.
+static uint64_t ReadProcValue(const char* path, const char* prefix, uint64_t default_value) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return default_value;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    uint64_t value;
+    if (android::base::StartsWith(line, prefix) &&
+        sscanf(line.c_str() + strlen(prefix), "%" SCNu64, &value) == 1) {
+      return value;
+    }
+  }
+  return default_value;
+}
+
+// Returns the file counting the OOM kills in the memory cgroup of this
+// process, which also holds the tests, or /proc/vmstat that counts all of
+// the OOM kills of the system.
+static std::string FindOomKillFile() {
+  std::string content;
+  if (android::base::ReadFileToString("/proc/self/cgroup", &content)) {
+    for (const auto& line : android::base::Split(content, "\n")) {
+      std::string file;
+      size_t memory = line.find(":memory:");
+      if (android::base::StartsWith(line, "0::")) {
+        file = "/sys/fs/cgroup" + line.substr(3) + "/memory.events";
+      } else if (memory != std::string::npos) {
+        file = "/sys/fs/cgroup/memory" + line.substr(memory + 8) + "/memory.oom_control";
+      }
+      if (!file.empty() && ReadProcValue(file.c_str(), "oom_kill ", UINT64_MAX) != UINT64_MAX) {
+        return file;
+      }
+    }
+  }
+  return "/proc/vmstat";
+}
 
 static std::string PluralizeString(size_t value, const char* name, bool uppercase = false) {
   std::string string(std::to_string(value) + name);
@@ -81,292 +217,1712 @@ static std::string PluralizeString(size_t value, const char* name, bool uppercas
   return string;
 }
 
+// Sent by a child running a batch of tests, the parent acknowledges every
+// BATCH_TEST_END with one byte once it has read the output of that test.
+struct BatchMessage {
+  enum Type : uint32_t {
+    BATCH_TEST_START = 0,
+    BATCH_TEST_END,
+  };
+  Type type;
+  uint32_t position;
+  uint32_t failed;
+};
+
+// Matches a single gtest filter pattern against name. The pattern supports
+// the '*' and '?' wildcards.
+static bool PatternMatches(const char* pattern, const char* pattern_end, const char* name) {
+  const char* star = nullptr;
+  const char* star_name = nullptr;
+  while (*name != '\0') {
+    if (pattern != pattern_end && (*pattern == '?' || *pattern == *name)) {
+      pattern++;
+      name++;
+    } else if (pattern != pattern_end && *pattern == '*') {
+      star = pattern++;
+      star_name = name;
+    } else if (star != nullptr) {
+      // Let the last '*' consume one more character and retry.
+      pattern = star + 1;
+      name = ++star_name;
+    } else {
+      return false;
+    }
+  }
+  while (pattern != pattern_end && *pattern == '*') {
+    pattern++;
+  }
+  return pattern == pattern_end;
+}
+
+// Returns true if name matches any of the ':' separated patterns.
+static bool PatternsMatch(const std::string& patterns, const std::string& name) {
+  size_t start = 0;
+  while (true) {
+    size_t end = patterns.find(':', start);
+    if (end == std::string::npos) {
+      end = patterns.size();
+    }
+    if (PatternMatches(&patterns[start], &patterns[end], name.c_str())) {
+      return true;
+    }
+    if (end == patterns.size()) {
+      return false;
+    }
+    start = end + 1;
+  }
+}
+
 void Isolate::EnumerateTests() {
-  // Only apply --gtest_filter if present. This is the only option that changes
-  // what tests are listed.
-  std::string command(child_args_[0]);
-  if (!options_.filter().empty()) {
-    command += " --gtest_filter=" + options_.filter();
+  if (::testing::UnitTest::GetInstance()->total_test_suite_count() > 0) {
+    EnumerateTestsFromRegistry();
+    Binary* binary = &binaries_[0];
+    binary->tests_end = tests_.size();
+    binary->total_suites = total_suites_;
+    binary->total_disable_tests = total_disable_tests_;
+    return;
   }
-  command += " --gtest_list_tests";
-#if defined(__APPLE__)
-  FILE* fp = popen(command.c_str(), "r");
-#else
-  FILE* fp = popen(command.c_str(), "re");
+
+  StartListings(false);
+  ReadListings();
+  listed_ns_ = NanoTime();
+}
+
+void Isolate::StartListings(bool stream) {
+  // The tests are not registered in this process, get them from the
+  // binaries. All of the binaries list their tests at the same time.
+  size_t total_shards = options_.total_shards();
+  for (const auto& binary : binaries_) {
+    // Only apply --gtest_filter if present. This is the only option that
+    // changes what tests are listed.
+    std::string command(binary.args[0]);
+    if (!options_.filter().empty()) {
+      command += " --gtest_filter=" + options_.filter();
+    }
+    command += " --gtest_list_tests";
+    listings_.emplace_back();
+    Listing* listing = &listings_.back();
+    listing->command = command;
+    android::base::unique_fd write_fd;
+    if (!android::base::Pipe(&listing->fd, &write_fd)) {
+      PLOG(FATAL) << "Unexpected failure from pipe";
+    }
+    if (stream && fcntl(listing->fd.get(), F_SETFL, O_NONBLOCK) == -1) {
+      PLOG(FATAL) << "Unexpected failure from fcntl";
+    }
+    // The same as popen, except that the pid is known so that the main loop
+    // can tell the listing processes from the tests when reaping children.
+    pid_t pid = fork();
+    if (pid == -1) {
+      PLOG(FATAL) << "Unexpected failure from fork";
+    }
+    if (pid == 0) {
+      dup2(write_fd, STDOUT_FILENO);
+      execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+      _exit(127);
+    }
+    listing->pid = pid;
+    // Other sharding modes are applied once all tests are known.
+    listing->sharded = total_shards > 1 && options_.sharding() == "round_robin";
+    if (listing->sharded) {
+      listing->test_count = options_.shard_index() + 1;
+    }
+  }
+  enumerating_ = stream;
+}
+
+bool Isolate::ReadListings() {
+  // Drain every listing, so that no binary blocks on a full pipe. The
+  // listings are blocking unless the tests are streamed.
+  for (size_t i = cur_listing_; i < listings_.size(); i++) {
+    Listing* listing = &listings_[i];
+    char buffer[4096];
+    while (!listing->done) {
+      ssize_t bytes = TEMP_FAILURE_RETRY(read(listing->fd, buffer, sizeof(buffer)));
+      if (bytes == -1) {
+        if (errno == EAGAIN) {
+          break;
+        }
+        PLOG(FATAL) << "Unexpected failure from read of test listing";
+      }
+      if (bytes == 0) {
+        listing->done = true;
+#if defined(__linux__)
+        if (listing->polled) {
+          EpollDel(epoll_fd_, listing->fd);
+          listing->polled = false;
+        }
 #endif
-  if (fp == nullptr) {
-    PLOG(FATAL) << "Unexpected failure from popen";
+      } else {
+        listing->data.append(buffer, bytes);
+      }
+    }
+  }
+
+  while (cur_listing_ < listings_.size()) {
+    Listing* listing = &listings_[cur_listing_];
+    size_t start = 0;
+    size_t end;
+    while ((end = listing->data.find('\n', start)) != std::string::npos) {
+      ParseListingLine(listing, listing->data.substr(start, end - start));
+      start = end + 1;
+    }
+    listing->data.erase(0, start);
+    if (!listing->done) {
+      return false;
+    }
+    if (!listing->data.empty()) {
+      ParseListingLine(listing, listing->data);
+      listing->data.clear();
+    }
+    listing->fd.reset();
+    if (listing->pid != 0 && TEMP_FAILURE_RETRY(waitpid(listing->pid, nullptr, 0)) == -1) {
+      PLOG(FATAL) << "Unexpected failure from waitpid";
+    }
+    listing->pid = 0;
+
+    Binary* binary = &binaries_[cur_listing_];
+    binary->tests_end = tests_.size();
+    binary->total_suites = total_suites_ - listing->total_suites;
+    binary->total_disable_tests = total_disable_tests_ - listing->total_disable_tests;
+    if (++cur_listing_ < listings_.size()) {
+      binaries_[cur_listing_].tests_begin = tests_.size();
+      listings_[cur_listing_].total_suites = total_suites_;
+      listings_[cur_listing_].total_disable_tests = total_disable_tests_;
+    }
+  }
+  return true;
+}
+
+size_t Isolate::BinaryIndex(size_t test_index) const {
+  auto binary = std::upper_bound(
+      binaries_.begin(), binaries_.end(), test_index,
+      [](size_t test_index, const Binary& binary) { return test_index < binary.tests_end; });
+  return binary - binaries_.begin();
+}
+
+std::string Isolate::HistoryName(size_t test_index) const {
+  std::string name(GetTestName(tests_[test_index]));
+  if (binaries_.size() > 1) {
+    // The same test name can be used by more than one binary.
+    return std::string(binaries_[BinaryIndex(test_index)].args[0]) + ':' + name;
+  }
+  return name;
+}
+
+void Isolate::EnumerateTestsFromRegistry() {
+  // Split the filter the same way gtest does: positive patterns, followed
+  // by an optional '-' and the negative patterns.
+  std::string positive(options_.filter());
+  std::string negative;
+  size_t dash_index = positive.find('-');
+  if (dash_index != std::string::npos) {
+    negative = positive.substr(dash_index + 1);
+    positive.erase(dash_index);
+  }
+  if (positive.empty()) {
+    positive = "*";
   }
 
   size_t total_shards = options_.total_shards();
-  bool sharded = total_shards > 1;
+  // Other sharding modes are applied once all tests are known.
+  bool sharded = total_shards > 1 && options_.sharding() == "round_robin";
   size_t test_count = 0;
   if (sharded) {
     test_count = options_.shard_index() + 1;
   }
 
-  bool skip_until_next_suite = false;
-  std::string suite_name;
-  char* buffer = nullptr;
-  size_t buffer_len = 0;
-  bool new_suite = false;
-  while (getline(&buffer, &buffer_len, fp) > 0) {
-    if (buffer[0] != ' ') {
-      // This is the case name.
-      suite_name = buffer;
-      auto space_index = suite_name.find(' ');
-      if (space_index != std::string::npos) {
-        suite_name.erase(space_index);
+  ::testing::UnitTest* unit_test = ::testing::UnitTest::GetInstance();
+  for (int i = 0; i < unit_test->total_test_suite_count(); i++) {
+    const ::testing::TestSuite* suite = unit_test->GetTestSuite(i);
+    std::string suite_name(std::string(suite->name()) + '.');
+    bool suite_disabled =
+        !options_.allow_disabled_tests() && android::base::StartsWith(suite->name(), "DISABLED_");
+    bool new_suite = true;
+    for (int j = 0; j < suite->total_test_count(); j++) {
+      const ::testing::TestInfo* info = suite->GetTestInfo(j);
+      std::string name(suite_name + info->name());
+      if (!PatternsMatch(positive, name) || (!negative.empty() && PatternsMatch(negative, name))) {
+        continue;
       }
-      if (suite_name.back() == '\n') {
-        suite_name.resize(suite_name.size() - 1);
+      bool test_disabled =
+          !options_.allow_disabled_tests() && android::base::StartsWith(info->name(), "DISABLED_");
+      if (suite_disabled || test_disabled) {
+        total_disable_tests_++;
+        continue;
       }
-
-      if (!options_.allow_disabled_tests() && android::base::StartsWith(suite_name, "DISABLED_")) {
-        // This whole set of tests have been disabled, skip them all.
-        skip_until_next_suite = true;
-      } else {
-        new_suite = true;
-        skip_until_next_suite = false;
-      }
-    } else if (buffer[0] == ' ' && buffer[1] == ' ') {
-      if (!skip_until_next_suite) {
-        std::string test_name = &buffer[2];
-        auto space_index = test_name.find(' ');
-        if (space_index != std::string::npos) {
-          test_name.erase(space_index);
+      if (!sharded || --test_count == 0) {
+        tests_.push_back(std::make_tuple(suite_name, info->name()));
+        test_infos_.push_back(info);
+        total_tests_++;
+        if (new_suite) {
+          // Only increment the number of suites when we find at least one test
+          // for the suites.
+          total_suites_++;
+          new_suite = false;
         }
-        if (test_name.back() == '\n') {
-          test_name.resize(test_name.size() - 1);
+        if (sharded) {
+          test_count = total_shards;
         }
-        if (options_.allow_disabled_tests() || !android::base::StartsWith(test_name, "DISABLED_")) {
-          if (!sharded || --test_count == 0) {
-            tests_.push_back(std::make_tuple(suite_name, test_name));
-            total_tests_++;
-            if (new_suite) {
-              // Only increment the number of suites when we find at least one test
-              // for the suites.
-              total_suites_++;
-              new_suite = false;
-            }
-            if (sharded) {
-              test_count = total_shards;
-            }
+      }
+    }
+  }
+}
+
+void Isolate::ParseListingLine(Listing* listing, const std::string& line) {
+  if (line.empty() || line[0] != ' ') {
+    // This is the case name.
+    std::string suite_name(line);
+    auto space_index = suite_name.find(' ');
+    if (space_index != std::string::npos) {
+      suite_name.erase(space_index);
+    }
+    listing->suite_name = suite_name;
+
+    if (!options_.allow_disabled_tests() && android::base::StartsWith(suite_name, "DISABLED_")) {
+      // This whole set of tests have been disabled, skip them all.
+      listing->skip_until_next_suite = true;
+    } else {
+      listing->new_suite = true;
+      listing->skip_until_next_suite = false;
+    }
+  } else if (line.size() > 1 && line[1] == ' ') {
+    if (!listing->skip_until_next_suite) {
+      std::string test_name(line.substr(2));
+      auto space_index = test_name.find(' ');
+      if (space_index != std::string::npos) {
+        test_name.erase(space_index);
+      }
+      if (options_.allow_disabled_tests() || !android::base::StartsWith(test_name, "DISABLED_")) {
+        if (!listing->sharded || --listing->test_count == 0) {
+          tests_.push_back(std::make_tuple(listing->suite_name, test_name));
+          // The test does not exist in this process, it runs from the binary.
+          test_infos_.push_back(nullptr);
+          total_tests_++;
+          if (listing->new_suite) {
+            // Only increment the number of suites when we find at least one test
+            // for the suites.
+            total_suites_++;
+            listing->new_suite = false;
+          }
+          if (listing->sharded) {
+            listing->test_count = options_.total_shards();
+          }
+          // Keep the ranges of the binaries that are still listing ordered,
+          // BinaryIndex is used to launch the tests that are already listed.
+          for (size_t i = cur_listing_; i < binaries_.size(); i++) {
+            binaries_[i].tests_end = tests_.size();
           }
-        } else {
-          total_disable_tests_++;
         }
       } else {
         total_disable_tests_++;
       }
     } else {
-      printf("Unexpected output from test listing.\nCommand:\n%s\nLine:\n%s\n", command.c_str(),
-             buffer);
-      exit(1);
+      total_disable_tests_++;
+    }
+  } else {
+    printf("Unexpected output from test listing.\nCommand:\n%s\nLine:\n%s\n",
+           listing->command.c_str(), line.c_str());
+    exit(1);
+  }
+}
+
+void Isolate::LoadTestDurations(const std::string& file,
+                                std::map<std::string, uint64_t>* durations_ms) {
+  std::string content;
+  if (!android::base::ReadFileToString(file, &content)) {
+    // There is no history on the first run.
+    return;
+  }
+  // Every line is the test name followed by its run time in ms.
+  for (const auto& line : android::base::Split(content, "\n")) {
+    size_t space = line.rfind(' ');
+    uint64_t duration_ms;
+    if (space != std::string::npos &&
+        android::base::ParseUint(line.substr(space + 1), &duration_ms)) {
+      (*durations_ms)[line.substr(0, space)] = duration_ms;
+    }
+  }
+}
+
+std::vector<uint64_t> Isolate::EstimateDurationsMs(
+    const std::map<std::string, uint64_t>& durations_ms) const {
+  // Tests without history are estimated from the average of their suite,
+  // or the average of all tests if the whole suite is new.
+  std::vector<uint64_t> estimates_ms(tests_.size(), UINT64_MAX);
+  std::unordered_map<std::string, std::pair<uint64_t, size_t>> suites;
+  uint64_t total_ms = 0;
+  size_t total_count = 0;
+  for (size_t i = 0; i < tests_.size(); i++) {
+    auto entry = durations_ms.find(HistoryName(i));
+    if (entry != durations_ms.end()) {
+      estimates_ms[i] = entry->second;
+      auto& suite = suites[std::get<0>(tests_[i])];
+      suite.first += entry->second;
+      suite.second++;
+      total_ms += entry->second;
+      total_count++;
+    }
+  }
+  for (size_t i = 0; i < tests_.size(); i++) {
+    if (estimates_ms[i] != UINT64_MAX) {
+      continue;
+    }
+    auto suite = suites.find(std::get<0>(tests_[i]));
+    if (suite != suites.end()) {
+      estimates_ms[i] = suite->second.first / suite->second.second;
+    } else {
+      estimates_ms[i] = total_count == 0 ? 0 : total_ms / total_count;
+    }
+  }
+  return estimates_ms;
+}
+
+void Isolate::ScheduleTests() {
+  test_order_.resize(tests_.size());
+  std::iota(test_order_.begin(), test_order_.end(), 0);
+  if (test_durations_ms_.empty()) {
+    return;
+  }
+
+  // Start the longest tests first so that none of them is left for the end.
+  std::vector<uint64_t> estimates_ms(EstimateDurationsMs(test_durations_ms_));
+  std::stable_sort(test_order_.begin(), test_order_.end(), [&estimates_ms](size_t a, size_t b) {
+    return estimates_ms[a] > estimates_ms[b];
+  });
+}
+
+static uint64_t HashString(const std::string& str) {
+  // FNV-1a, which does not change between builds or hosts.
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Hashes output so that failures that only differ in line numbers, numbers
+// such as pids, or addresses hash the same. The name of the test must be
+// taken out of the output already.
+class FailureHasher {
+ public:
+  void Add(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      char c = data[i];
+      if (in_number_ && isdigit(c)) {
+        continue;
+      }
+      in_number_ = false;
+      if (in_hex_ && isxdigit(c)) {
+        continue;
+      }
+      in_hex_ = false;
+      if (isdigit(c) && (last_ == ':' || last_ == '(' || last_ == '=')) {
+        // A line number, as in file:(10) or file:10, or a pid as in ==10==.
+        Hash('N');
+        in_number_ = true;
+      } else {
+        Hash(c);
+        in_hex_ = c == 'x' && last_ == '0';
+      }
+      last_ = c;
+    }
+  }
+
+  uint64_t hash() const { return hash_; }
+
+ private:
+  void Hash(char c) {
+    hash_ ^= static_cast<unsigned char>(c);
+    hash_ *= 0x100000001b3ULL;
+  }
+
+  // FNV-1a.
+  uint64_t hash_ = 0xcbf29ce484222325ULL;
+  char last_ = '\0';
+  bool in_number_ = false;
+  bool in_hex_ = false;
+};
+
+static uint64_t MixHash(uint64_t value) {
+  // The splitmix64 finalizer.
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+std::vector<size_t> Isolate::BalanceShards(const std::vector<uint64_t>& estimates_ms) const {
+  // Give the longest remaining test to the shard with the least work so far.
+  // Every shard computes the same assignment, so ties always go to the
+  // earlier test and the lower shard. Every test costs at least 1 ms so that
+  // tests without any history are still spread across the shards.
+  std::vector<size_t> order(tests_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&estimates_ms](size_t a, size_t b) {
+    return estimates_ms[a] > estimates_ms[b];
+  });
+  std::vector<uint64_t> shard_ms(options_.total_shards());
+  std::vector<size_t> shards(tests_.size());
+  for (size_t test_index : order) {
+    size_t shard = std::min_element(shard_ms.begin(), shard_ms.end()) - shard_ms.begin();
+    shard_ms[shard] += std::max<uint64_t>(estimates_ms[test_index], 1);
+    shards[test_index] = shard;
+  }
+  return shards;
+}
+
+std::vector<size_t> Isolate::HashShards(bool by_suite) const {
+  // Rendezvous hashing: every test goes to the shard with the highest hash
+  // of the test and the shard. Adding or removing a test never moves any
+  // other test, and adding a shard only moves the tests that now hash
+  // highest to the new shard.
+  size_t total_shards = options_.total_shards();
+  std::vector<size_t> shards(tests_.size());
+  for (size_t i = 0; i < tests_.size(); i++) {
+    if (by_suite && i > 0 && std::get<0>(tests_[i]) == std::get<0>(tests_[i - 1]) &&
+        BinaryIndex(i) == BinaryIndex(i - 1)) {
+      // The tests of a suite are next to each other.
+      shards[i] = shards[i - 1];
+      continue;
+    }
+    std::string key(by_suite ? std::get<0>(tests_[i]) : GetTestName(tests_[i]));
+    if (binaries_.size() > 1) {
+      key = std::string(binaries_[BinaryIndex(i)].args[0]) + ':' + key;
     }
+    uint64_t key_hash = HashString(key);
+    uint64_t max_weight = 0;
+    for (size_t shard = 0; shard < total_shards; shard++) {
+      uint64_t weight = MixHash(key_hash + MixHash(shard));
+      if (shard == 0 || weight > max_weight) {
+        max_weight = weight;
+        shards[i] = shard;
+      }
+    }
+  }
+  return shards;
+}
+
+void Isolate::ShardTests() {
+  std::map<std::string, uint64_t> durations_ms;
+  if (!options_.shard_durations_file().empty()) {
+    LoadTestDurations(options_.shard_durations_file(), &durations_ms);
+  }
+  std::vector<uint64_t> estimates_ms(EstimateDurationsMs(durations_ms));
+
+  std::vector<size_t> shards;
+  if (options_.sharding() == "balanced") {
+    shards = BalanceShards(estimates_ms);
+  } else {
+    shards = HashShards(options_.sharding() == "hash_suite");
   }
-  free(buffer);
-  if (pclose(fp) == -1) {
-    PLOG(FATAL) << "Unexpected failure from pclose";
+
+  size_t total_shards = options_.total_shards();
+  std::vector<size_t> shard_tests(total_shards);
+  std::vector<uint64_t> shard_ms(total_shards);
+  std::vector<bool> keep(tests_.size());
+  for (size_t i = 0; i < tests_.size(); i++) {
+    shard_tests[shards[i]]++;
+    shard_ms[shards[i]] += estimates_ms[i];
+    keep[i] = shards[i] == static_cast<size_t>(options_.shard_index());
+  }
+  // Every shard prints the whole assignment, so that any one log shows how
+  // evenly the tests were split.
+  for (size_t shard = 0; shard < total_shards; shard++) {
+    ColoredPrintf(COLOR_YELLOW, "Note: Shard %zu of %zu has %s, estimated %" PRIu64 " ms",
+                  shard + 1, total_shards, PluralizeString(shard_tests[shard], " test").c_str(),
+                  shard_ms[shard]);
+    printf("\n");
   }
+  FilterTests(keep);
 }
 
-int Isolate::ChildProcessFn(const std::tuple<std::string, std::string>& test) {
-  // Make sure the filter is only coming from our command-line option.
-  unsetenv("GTEST_FILTER");
+void Isolate::FilterTests(const std::vector<bool>& keep) {
+  size_t count = 0;
+  total_suites_ = 0;
+  for (auto& binary : binaries_) {
+    size_t begin = count;
+    binary.total_suites = 0;
+    for (size_t i = binary.tests_begin; i < binary.tests_end; i++) {
+      if (!keep[i]) {
+        continue;
+      }
+      // The tests of a suite are next to each other.
+      if (count == begin || std::get<0>(tests_[i]) != std::get<0>(tests_[count - 1])) {
+        binary.total_suites++;
+      }
+      if (count != i) {
+        tests_[count] = std::move(tests_[i]);
+        test_infos_[count] = test_infos_[i];
+      }
+      count++;
+    }
+    binary.tests_begin = begin;
+    binary.tests_end = count;
+    total_suites_ += binary.total_suites;
+  }
+  tests_.resize(count);
+  test_infos_.resize(count);
+  total_tests_ = count;
+}
 
-  // Add the filter argument.
-  std::vector<const char*> args(child_args_);
-  std::string filter("--gtest_filter=" + GetTestName(test));
-  args.push_back(filter.c_str());
+void Isolate::WriteTestDurations() {
+  for (const auto& entry : finished_) {
+    if (entry.second->result() != TEST_NOT_RUN) {
+      test_durations_ms_[HistoryName(entry.first)] = entry.second->RunTimeNs() / kNsPerMs;
+    }
+  }
+  std::string content;
+  for (const auto& entry : test_durations_ms_) {
+    content += entry.first + ' ' + std::to_string(entry.second) + '\n';
+  }
+  // Replace the file atomically so that a concurrent reader never sees a
+  // partial file.
+  const std::string& file = options_.test_durations_file();
+  std::string tmp_file(file + ".tmp");
+  if (!android::base::WriteStringToFile(content, tmp_file) ||
+      rename(tmp_file.c_str(), file.c_str()) == -1) {
+    printf("Cannot write test durations file '%s': %s\n", file.c_str(), strerror(errno));
+    unlink(tmp_file.c_str());
+  }
+}
 
+void Isolate::LoadTimingDb() {
+  timing_db_.reset(new TimingDb(options_.timing_db_file(), TimingDb::GetBinaryId()));
+  timing_db_->Load();
+  // Without registered tests, the tests come from binaries other than this
+  // one and each keeps its own history. A binary gets the same id whether it
+  // runs its own tests or they are run from here.
+  bool registered = ::testing::UnitTest::GetInstance()->total_test_suite_count() > 0;
+  for (auto& binary : binaries_) {
+    binary.timing_hash = TimingDb::BinaryHash(registered ? TimingDb::GetBinaryId()
+                                                         : TimingDb::GetBinaryId(binary.args[0]));
+  }
+  for (size_t i = 0; i < tests_.size(); i++) {
+    const TimingDb::Record* record =
+        timing_db_->Find(binaries_[BinaryIndex(i)].timing_hash, GetTestName(tests_[i]));
+    if (record != nullptr) {
+      test_durations_ms_[HistoryName(i)] = TimingDb::AverageDurationMs(*record);
+    }
+  }
+}
+
+void Isolate::UpdateTimingDb() {
+  for (const auto& entry : finished_) {
+    const Test* test = entry.second.get();
+    if (test->result() == TEST_NOT_RUN) {
+      continue;
+    }
+    timing_db_->Add(binaries_[BinaryIndex(entry.first)].timing_hash,
+                    GetTestName(tests_[entry.first]), test->RunTimeNs() / kNsPerMs,
+                    test->result(), test->peak_rss_kb());
+  }
+  if (!timing_db_->Write()) {
+    printf("Cannot write timing database '%s': %s\n", options_.timing_db_file().c_str(),
+           strerror(errno));
+  }
+}
+
+void Isolate::InitGtest() {
+  // Initialize gtest once in the parent so that every child inherits the
+  // parsed flags and the fully registered tests (including parameterized
+  // tests) instead of redoing that work after every fork.
+  std::vector<const char*> args(binaries_[0].args);
   int argc = args.size();
   // Add the null terminator.
   args.push_back(nullptr);
   ::testing::InitGoogleTest(&argc, const_cast<char**>(args.data()));
+}
+
+int Isolate::ChildProcessFn(size_t test_index) {
+  // Sharding was applied by the parent, do not let gtest shard again.
+  unsetenv("GTEST_TOTAL_SHARDS");
+  unsetenv("GTEST_SHARD_INDEX");
+
+  const ::testing::TestInfo* info = test_infos_[test_index];
+  if (info == nullptr) {
+    // Run the test from the binary that listed it.
+    unsetenv("GTEST_FILTER");
+    std::vector<const char*> args(binaries_[BinaryIndex(test_index)].args);
+    std::string filter("--gtest_filter=" + GetTestName(tests_[test_index]));
+    args.push_back(filter.c_str());
+    // Print the output the same way as a child forked from the binary.
+    args.push_back("--isolated_child");
+    args.push_back(nullptr);
+    execv(args[0], const_cast<char**>(args.data()));
+    printf("Unexpected failure from execv: %s\n", strerror(errno));
+    return 1;
+  }
+
+  // The flags and registry were set up by the parent, only select the one
+  // test to run. gtest has no public way to run a single TestInfo, so
+  // RUN_ALL_TESTS still matches the filter against every registered test,
+  // which makes the cost of a child linear in the size of the registry.
+  // What the parent saves the child is parsing the flags, registering the
+  // tests and building the filter from the name.
+  ::testing::GTEST_FLAG(filter) = std::string(info->test_suite_name()) + '.' + info->name();
   return RUN_ALL_TESTS();
 }
 
-void Isolate::LaunchTests() {
-  while (!running_indices_.empty() && cur_test_index_ < tests_.size()) {
+class BatchListener : public ::testing::EmptyTestEventListener {
+ public:
+  BatchListener(int fd, std::unordered_map<const ::testing::TestInfo*, uint32_t> positions)
+      : fd_(fd), positions_(std::move(positions)) {}
+  ~BatchListener() override = default;
+
+  void OnTestStart(const ::testing::TestInfo& test_info) override {
+    Send(BatchMessage::BATCH_TEST_START, test_info);
+  }
+
+  void OnTestEnd(const ::testing::TestInfo& test_info) override {
+    // All of the output of the test must be in the pipe before the parent
+    // is told that the test ended.
+    fflush(stdout);
+    fflush(stderr);
+    Send(BatchMessage::BATCH_TEST_END, test_info);
+    char ack;
+    if (TEMP_FAILURE_RETRY(read(fd_, &ack, sizeof(ack))) != sizeof(ack)) {
+      // The parent is gone.
+      _exit(1);
+    }
+  }
+
+ private:
+  void Send(BatchMessage::Type type, const ::testing::TestInfo& test_info) {
+    BatchMessage message = {
+        .type = type,
+        .position = positions_.at(&test_info),
+        .failed = test_info.result()->Failed(),
+    };
+    if (TEMP_FAILURE_RETRY(write(fd_, &message, sizeof(message))) != sizeof(message)) {
+      _exit(1);
+    }
+  }
+
+  int fd_;
+  std::unordered_map<const ::testing::TestInfo*, uint32_t> positions_;
+};
+
+int Isolate::BatchChildProcessFn(const std::vector<size_t>& test_indices, int control_fd) {
+  unsetenv("GTEST_TOTAL_SHARDS");
+  unsetenv("GTEST_SHARD_INDEX");
+
+  // gtest runs the tests in registry order, which is the order of tests_,
+  // so the positions are reported in the same order as test_indices.
+  std::string filter;
+  std::unordered_map<const ::testing::TestInfo*, uint32_t> positions;
+  for (size_t i = 0; i < test_indices.size(); i++) {
+    const ::testing::TestInfo* info = test_infos_[test_indices[i]];
+    if (i != 0) {
+      filter += ':';
+    }
+    filter += std::string(info->test_suite_name()) + '.' + info->name();
+    positions[info] = i;
+  }
+  ::testing::GTEST_FLAG(filter) = filter;
+  ::testing::UnitTest::GetInstance()->listeners().Append(
+      new BatchListener(control_fd, std::move(positions)));
+  return RUN_ALL_TESTS();
+}
+
+std::vector<size_t> Isolate::WaitForTests(int control_fd) {
+  std::vector<size_t> indices(options_.batch_size());
+  pollfd pfd = {.fd = control_fd, .events = POLLIN};
+  while (true) {
+    int ready = TEMP_FAILURE_RETRY(poll(&pfd, 1, 1000));
+    if (ready == -1) {
+      exit(1);
+    }
+    if (ready == 0) {
+      // The runner does not always get to release this child, for example
+      // if it crashed. Once the child is reparented away from it, give up.
+      if (getppid() != runner_pid_) {
+        exit(0);
+      }
+      continue;
+    }
+    ssize_t bytes = TEMP_FAILURE_RETRY(
+        recv(control_fd, indices.data(), indices.size() * sizeof(size_t), 0));
+    if (bytes <= 0) {
+      exit(0);
+    }
+    indices.resize(bytes / sizeof(size_t));
+    return indices;
+  }
+}
+
+void Isolate::RunChild(const std::vector<size_t>& test_indices, int output_fd, int control_fd) {
+  if (test_indices.empty()) {
+    // A preforked child, wait until tests are assigned to it.
+    RunChild(WaitForTests(control_fd), output_fd, control_fd);
+  }
+  close(STDOUT_FILENO);
+  close(STDERR_FILENO);
+  if (dup2(output_fd, STDOUT_FILENO) == -1) {
+    exit(1);
+  }
+  if (dup2(output_fd, STDERR_FILENO) == -1) {
+    exit(1);
+  }
+  UnregisterSignalHandler();
+  if (test_indices.size() > 1) {
+    exit(BatchChildProcessFn(test_indices, control_fd));
+  }
+  exit(ChildProcessFn(test_indices[0]));
+}
+
+#if defined(__linux__)
+void Isolate::StartForkServer() {
+  // The server forks every child from a short lived intermediate process,
+  // which makes this process the parent of the child once the intermediate
+  // exits. That way children are still reaped here.
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+    PLOG(FATAL) << "Unexpected failure from prctl";
+  }
+  android::base::unique_fd server_fd;
+  if (!android::base::Socketpair(AF_UNIX, SOCK_SEQPACKET, 0, &fork_server_fd_, &server_fd)) {
+    PLOG(FATAL) << "Unexpected failure from socketpair";
+  }
+  // Do not let the server or its children flush anything buffered here.
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    PLOG(FATAL) << "Unexpected failure from fork";
+  }
+  if (pid == 0) {
+    fork_server_fd_.reset();
+    _exit(ForkServerFn(server_fd));
+  }
+}
+
+int Isolate::ForkServerFn(int server_fd) {
+  // The test count followed by the test indices, the count is zero for a
+  // preforked child.
+  std::vector<uint64_t> indices(options_.batch_size() + 1);
+  std::vector<size_t> test_indices;
+  std::vector<android::base::unique_fd> fds;
+  while (true) {
+    ssize_t bytes = android::base::ReceiveFileDescriptorVector(
+        server_fd, indices.data(), indices.size() * sizeof(uint64_t), 2, &fds);
+    if (bytes < static_cast<ssize_t>(sizeof(uint64_t)) || fds.empty()) {
+      // The runner is gone.
+      return 0;
+    }
+    test_indices.assign(indices.begin() + 1, indices.begin() + 1 + indices[0]);
+    int control_fd = fds.size() > 1 ? fds[1].get() : -1;
+
     android::base::unique_fd read_fd, write_fd;
     if (!Pipe(&read_fd, &write_fd)) {
       PLOG(FATAL) << "Unexpected failure from pipe";
     }
-    if (fcntl(read_fd.get(), F_SETFL, O_NONBLOCK) == -1) {
+    // The pid of the child, or -1 and the errno from fork.
+    int32_t reply[2] = {-1, 0};
+    pid_t intermediate_pid = fork();
+    if (intermediate_pid == 0) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(server_fd);
+        RunChild(test_indices, fds[0], control_fd);
+      }
+      reply[0] = pid;
+      reply[1] = errno;
+      _exit(TEMP_FAILURE_RETRY(write(write_fd, reply, sizeof(reply))) == sizeof(reply) ? 0 : 1);
+    }
+    fds.clear();
+    write_fd.reset();
+    if (intermediate_pid == -1) {
+      reply[1] = errno;
+    } else {
+      if (TEMP_FAILURE_RETRY(read(read_fd, reply, sizeof(reply))) != sizeof(reply)) {
+        reply[0] = -1;
+        reply[1] = EIO;
+      }
+      // The child is reparented once this returns.
+      if (TEMP_FAILURE_RETRY(waitpid(intermediate_pid, nullptr, 0)) == -1) {
+        PLOG(FATAL) << "Unexpected failure from waitpid";
+      }
+    }
+    if (TEMP_FAILURE_RETRY(send(server_fd, reply, sizeof(reply), 0)) != sizeof(reply)) {
+      return 1;
+    }
+  }
+}
+
+pid_t Isolate::ForkFromServer(const std::vector<size_t>& test_indices, int output_fd,
+                              int control_fd) {
+  std::vector<uint64_t> indices{test_indices.size()};
+  indices.insert(indices.end(), test_indices.begin(), test_indices.end());
+  std::vector<int> fds{output_fd};
+  if (control_fd != -1) {
+    fds.push_back(control_fd);
+  }
+  if (android::base::SendFileDescriptorVector(fork_server_fd_, indices.data(),
+                                              indices.size() * sizeof(uint64_t), fds) == -1) {
+    PLOG(FATAL) << "Unexpected failure sending to the fork server";
+  }
+  int32_t reply[2];
+  if (TEMP_FAILURE_RETRY(recv(fork_server_fd_, reply, sizeof(reply), 0)) != sizeof(reply)) {
+    PLOG(FATAL) << "Unexpected failure receiving from the fork server";
+  }
+  if (reply[0] == -1) {
+    errno = reply[1];
+    PLOG(FATAL) << "Unexpected failure from fork";
+  }
+  return reply[0];
+}
+#endif
+
+pid_t Isolate::ForkChild(const std::vector<size_t>& test_indices, int output_fd, int control_fd) {
+#if defined(__linux__)
+  if (fork_server_fd_ != -1) {
+    return ForkFromServer(test_indices, output_fd, control_fd);
+  }
+#endif
+  pid_t pid = fork();
+  if (pid == -1) {
+    PLOG(FATAL) << "Unexpected failure from fork";
+  }
+  if (pid == 0) {
+    RunChild(test_indices, output_fd, control_fd);
+  }
+  return pid;
+}
+
+pid_t Isolate::SpawnChild(const std::vector<size_t>& test_indices,
+                          android::base::unique_fd* output_fd,
+                          android::base::unique_fd* control_fd) {
+  android::base::unique_fd write_fd;
+#if defined(__linux__)
+  if (output_in_file_) {
+    // The child writes through a copy of the fd, which shares the file
+    // offset, so the output is only ever read with pread.
+    output_fd->reset(memfd_create("gtest_output", MFD_CLOEXEC));
+    if (*output_fd == -1) {
+      PLOG(FATAL) << "Unexpected failure from memfd_create";
+    }
+    write_fd.reset(fcntl(output_fd->get(), F_DUPFD_CLOEXEC, 0));
+    if (write_fd == -1) {
+      PLOG(FATAL) << "Unexpected failure from fcntl";
+    }
+  } else
+#endif
+  {
+    if (!Pipe(output_fd, &write_fd)) {
+      PLOG(FATAL) << "Unexpected failure from pipe";
+    }
+    if (fcntl(output_fd->get(), F_SETFL, O_NONBLOCK) == -1) {
+      PLOG(FATAL) << "Unexpected failure from fcntl";
+    }
+#if defined(__linux__)
+    // Not an error, the pipe keeps the default size if this is over the
+    // limits of the system.
+    fcntl(output_fd->get(), F_SETPIPE_SZ, kPipeSize);
+#endif
+  }
+  // A preforked child receives its tests over the control socket.
+  android::base::unique_fd child_control_fd;
+  if (test_indices.size() != 1) {
+    if (!android::base::Socketpair(AF_UNIX, SOCK_DGRAM, 0, control_fd, &child_control_fd)) {
+      PLOG(FATAL) << "Unexpected failure from socketpair";
+    }
+    if (fcntl(control_fd->get(), F_SETFL, O_NONBLOCK) == -1) {
       PLOG(FATAL) << "Unexpected failure from fcntl";
     }
+  }
+  return ForkChild(test_indices, write_fd, child_control_fd);
+}
 
-    pid_t pid = fork();
-    if (pid == -1) {
-      PLOG(FATAL) << "Unexpected failure from fork";
+bool Isolate::MemoryLow() {
+  uint64_t now_ns = NanoTime();
+  if (now_ns >= memory_check_ns_) {
+    memory_low_ = (options_.max_memory_pressure() != 0 &&
+                   ReadMemoryPressure() > options_.max_memory_pressure()) ||
+                  (options_.min_available_memory_mb() != 0 &&
+                   ReadProcValue("/proc/meminfo", "MemAvailable:", UINT64_MAX) <
+                       options_.min_available_memory_mb() * 1024);
+    memory_check_ns_ = now_ns + kMemoryCheckIntervalNs;
+  }
+  return memory_low_;
+}
+
+void Isolate::LaunchTests() {
+  launch_held_ = false;
+  if (failure_limit_reached_) {
+    return;
+  }
+  // Failed tests run again once every other test of the iteration was launched.
+  auto tests_left = [this]() {
+    return !pending_batches_.empty() || cur_test_index_ < tests_.size() ||
+           (!enumerating_ && !retry_tests_.empty());
+  };
+  while (!running_indices_.empty() && running_by_pid_.size() < job_limit_ && tests_left()) {
+    // Always keep one test running so that the run makes progress.
+    if (!running_by_pid_.empty() && options_.memory_control() && MemoryLow()) {
+      launch_held_ = true;
+      return;
     }
-    if (pid == 0) {
-      read_fd.reset();
-      close(STDOUT_FILENO);
-      close(STDERR_FILENO);
-      if (dup2(write_fd, STDOUT_FILENO) == -1) {
-        exit(1);
+
+    std::vector<size_t> test_indices;
+    if (!pending_batches_.empty()) {
+      test_indices = std::move(pending_batches_.front());
+      pending_batches_.pop_front();
+    } else if (cur_test_index_ < tests_.size()) {
+      test_indices.push_back(test_order_[cur_test_index_++]);
+      // Tests that are not registered in this process cannot be batched.
+      while (test_indices.size() < options_.batch_size() && cur_test_index_ < tests_.size() &&
+             test_infos_[test_order_[cur_test_index_]] != nullptr) {
+        test_indices.push_back(test_order_[cur_test_index_++]);
       }
-      if (dup2(write_fd, STDERR_FILENO) == -1) {
-        exit(1);
+      // A batch runs its tests in registry order.
+      std::sort(test_indices.begin(), test_indices.end());
+    } else {
+      test_indices.push_back(retry_tests_.front());
+      retry_tests_.pop_front();
+    }
+    size_t test_index = test_indices[0];
+    bool batch = test_indices.size() > 1;
+    // Read before the test starts, so that the count cannot include its own kill.
+    uint64_t oom_kill_count = options_.memory_control() ? ReadOomKillCount() : 0;
+
+    pid_t pid = 0;
+    android::base::unique_fd read_fd, control_fd;
+    while (pid == 0 && !preforked_.empty()) {
+      Prefork& child = preforked_.front();
+      if (TEMP_FAILURE_RETRY(send(child.control_fd, test_indices.data(),
+                                  test_indices.size() * sizeof(size_t), 0)) != -1) {
+        pid = child.pid;
+        read_fd = std::move(child.output_fd);
+        control_fd = std::move(child.control_fd);
+      } else {
+        // The child cannot take the tests, get rid of it.
+        kill(child.pid, SIGKILL);
+        if (TEMP_FAILURE_RETRY(waitpid(child.pid, nullptr, 0)) == -1) {
+          PLOG(FATAL) << "Unexpected failure from waitpid";
+        }
       }
-      UnregisterSignalHandler();
-      exit(ChildProcessFn(tests_[cur_test_index_]));
+      preforked_.pop_front();
+    }
+    if (pid == 0) {
+      pid = SpawnChild(test_indices, &read_fd, &control_fd);
     }
 
     size_t run_index = running_indices_.back();
     running_indices_.pop_back();
-    Test* test = new Test(tests_[cur_test_index_], cur_test_index_, run_index, read_fd.release());
+    Test* test = new Test(tests_[test_index], test_index, run_index, read_fd.release());
+    auto attempts = failed_attempts_.find(test_index);
+    if (attempts != failed_attempts_.end()) {
+      test->set_retry_count(attempts->second.size());
+    }
+    test->set_output_limit(options_.output_limit_kb() * 1024);
+    if (!options_.output_dir().empty()) {
+      OpenLog(test);
+    }
+    if (output_in_file_) {
+      test->SetOutputFile(0);
+    }
+    test->set_oom_kill_count(oom_kill_count);
     running_by_pid_.emplace(pid, test);
     running_[run_index] = test;
-    running_by_test_index_[cur_test_index_] = test;
+    running_by_test_index_[test_index] = test;
+    AddTimers(pid, test);
+    if (first_launch_ns_ == 0) {
+      first_launch_ns_ = test->start_ns();
+    }
 
-    pollfd* pollfd = &running_pollfds_[run_index];
-    pollfd->fd = test->fd();
-    pollfd->events = POLLIN;
-    cur_test_index_++;
+    // Output that goes to a file is not read while the test runs.
+    if (!output_in_file_) {
+      pollfd* pollfd = &running_pollfds_[run_index];
+      pollfd->fd = test->fd();
+      pollfd->events = POLLIN;
+#if defined(__linux__)
+      EpollAdd(epoll_fd_, test->fd(), EVENT_OUTPUT, run_index);
+#endif
+    }
+#if defined(__linux__)
+    if (use_pidfd_) {
+      running_pidfds_[run_index].reset(PidfdOpen(pid));
+      if (running_pidfds_[run_index] == -1) {
+        PLOG(FATAL) << "Unexpected failure from pidfd_open";
+      }
+      EpollAdd(epoll_fd_, running_pidfds_[run_index], EVENT_EXIT, run_index);
+    }
+#endif
+    if (batch) {
+#if defined(__linux__)
+      EpollAdd(epoll_fd_, control_fd, EVENT_CONTROL, run_index);
+#endif
+      Batch* state = &running_batches_[run_index];
+      state->pid = pid;
+      state->test_indices = std::move(test_indices);
+      state->control_fd = std::move(control_fd);
+    }
+  }
+
+  // Fork the children for the next free slots now, while the tests run.
+  // A preforked child only knows the tests listed when it was forked, so
+  // none are forked until all tests are listed.
+  while (!enumerating_ && preforked_.size() < options_.prefork() && tests_left()) {
+    Prefork child;
+    child.pid = SpawnChild(std::vector<size_t>(), &child.output_fd, &child.control_fd);
+    preforked_.push_back(std::move(child));
   }
 }
 
-void Isolate::ReadTestsOutput() {
-  int ready = poll(running_pollfds_.data(), running_pollfds_.size(), 0);
-  if (ready <= 0) {
-    return;
+void Isolate::ReleasePreforked() {
+  for (const auto& child : preforked_) {
+    kill(child.pid, SIGKILL);
+    if (TEMP_FAILURE_RETRY(waitpid(child.pid, nullptr, 0)) == -1) {
+      PLOG(FATAL) << "Unexpected failure from waitpid";
+    }
+  }
+  preforked_.clear();
+}
+
+void Isolate::InitEvents() {
+#if defined(__linux__)
+  sigemptyset(&g_blocked_signals);
+  sigaddset(&g_blocked_signals, SIGINT);
+  sigaddset(&g_blocked_signals, SIGQUIT);
+  // Child exits are reported through a pidfd per child. Kernels that do
+  // not support pidfds report them through SIGCHLD on the signalfd instead.
+  android::base::unique_fd self_pidfd(PidfdOpen(getpid()));
+  use_pidfd_ = self_pidfd != -1;
+  if (!use_pidfd_) {
+    sigaddset(&g_blocked_signals, SIGCHLD);
+  }
+  RegisterSignalHandler();
+
+  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (epoll_fd_ == -1) {
+    PLOG(FATAL) << "Unexpected failure from epoll_create1";
+  }
+  signal_fd_.reset(signalfd(-1, &g_blocked_signals, SFD_NONBLOCK | SFD_CLOEXEC));
+  if (signal_fd_ == -1) {
+    PLOG(FATAL) << "Unexpected failure from signalfd";
+  }
+  EpollAdd(epoll_fd_, signal_fd_, EVENT_SIGNAL, 0);
+  timer_fd_.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  if (timer_fd_ == -1) {
+    PLOG(FATAL) << "Unexpected failure from timerfd_create";
+  }
+  EpollAdd(epoll_fd_, timer_fd_, EVENT_TIMER, 0);
+#else
+  RegisterSignalHandler();
+#endif
+}
+
+void Isolate::WaitForEvents() {
+#if defined(__linux__)
+  // Arm the timer for the next time a running test becomes slow or
+  // reaches the deadline, the memory state is checked again, or finished
+  // tests are due to be written to the xml files.
+  uint64_t wake_ns = NextTimerNs();
+  if (launch_held_) {
+    wake_ns = std::min(wake_ns, memory_check_ns_);
+  }
+  for (uint64_t resume_ns : output_resume_ns_) {
+    if (resume_ns != 0) {
+      wake_ns = std::min(wake_ns, resume_ns);
+    }
+  }
+  for (const auto& writer : xml_writers_) {
+    if (writer) {
+      wake_ns = std::min(wake_ns, writer->flush_ns());
+    }
+  }
+  if (wake_ns != timer_armed_ns_) {
+    // A zero value disarms the timer.
+    itimerspec spec = {};
+    if (wake_ns != UINT64_MAX) {
+      spec.it_value.tv_sec = wake_ns / kNsPerS;
+      spec.it_value.tv_nsec = wake_ns % kNsPerS;
+    }
+    if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+      PLOG(FATAL) << "Unexpected failure from timerfd_settime";
+    }
+    timer_armed_ns_ = wake_ns;
   }
 
+  epoll_event events[32];
+  int ready =
+      TEMP_FAILURE_RETRY(epoll_wait(epoll_fd_, events, sizeof(events) / sizeof(events[0]), -1));
+  if (ready == -1) {
+    PLOG(FATAL) << "Unexpected failure from epoll_wait";
+  }
+  for (int i = 0; i < ready; i++) {
+    size_t index = events[i].data.u64 & UINT32_MAX;
+    switch (static_cast<EventType>(events[i].data.u64 >> 32)) {
+      case EVENT_OUTPUT:
+        running_pollfds_[index].revents = POLLIN;
+        break;
+      case EVENT_EXIT:
+        // The child is reaped in CheckTestsFinished.
+        break;
+      case EVENT_CONTROL:
+        // The messages are read in CheckBatchesProgress.
+        break;
+      case EVENT_LISTING:
+        // The listings are read in StreamTests.
+        break;
+      case EVENT_TIMER: {
+        uint64_t expirations;
+        if (TEMP_FAILURE_RETRY(read(timer_fd_, &expirations, sizeof(expirations))) == -1 &&
+            errno != EAGAIN) {
+          PLOG(FATAL) << "Unexpected failure from read of timerfd";
+        }
+        // Force the timer to be re-armed, even for the same value.
+        timer_armed_ns_ = 0;
+        break;
+      }
+      case EVENT_SIGNAL: {
+        signalfd_siginfo info;
+        while (TEMP_FAILURE_RETRY(read(signal_fd_, &info, sizeof(info))) == sizeof(info)) {
+          if (info.ssi_signo != SIGCHLD) {
+            g_signal = info.ssi_signo;
+          }
+        }
+        break;
+      }
+    }
+  }
+#else
+  if (poll(running_pollfds_.data(), running_pollfds_.size(), MIN_USECONDS_WAIT / 1000) == -1 &&
+      errno != EINTR) {
+    PLOG(FATAL) << "Unexpected failure from poll";
+  }
+#endif
+}
+
+void Isolate::ReadTestsOutput() {
+  uint64_t now_ns = NanoTime();
   for (size_t i = 0; i < running_pollfds_.size(); i++) {
     pollfd* pfd = &running_pollfds_[i];
-    if (pfd->revents & POLLIN) {
+    if (output_resume_ns_[i] != 0) {
+      if (now_ns < output_resume_ns_[i]) {
+        pfd->revents = 0;
+        continue;
+      }
+      output_resume_ns_[i] = 0;
+      running_[i]->ResumeOutput(now_ns);
+#if defined(__linux__)
+      EpollAdd(epoll_fd_, pfd->fd, EVENT_OUTPUT, i);
+#endif
+    }
+    if (pfd->fd != -1 && (pfd->revents & (POLLIN | POLLHUP))) {
       Test* test = running_[i];
       if (!test->Read()) {
+#if defined(__linux__)
+        EpollDel(epoll_fd_, test->fd());
+#endif
         test->CloseFd();
-        pfd->fd = 0;
+        pfd->fd = -1;
         pfd->events = 0;
+      } else {
+        ThrottleOutput(i, now_ns);
       }
     }
     pfd->revents = 0;
   }
 }
 
-size_t Isolate::CheckTestsFinished() {
+void Isolate::ThrottleOutput(size_t run_index, uint64_t now_ns) {
+  uint64_t rate = options_.max_output_rate_kb() * 1024;
+  Test* test = running_[run_index];
+  // A second worth of output is always allowed, past that the output is
+  // read no faster than the rate since the test started.
+  if (rate == 0 || test->output_bytes() <= rate) {
+    return;
+  }
+  uint64_t resume_ns =
+      test->start_ns() + (test->output_bytes() - rate) * 1000 / rate * kNsPerMs;
+  if (resume_ns <= now_ns) {
+    return;
+  }
+  test->PauseOutput(now_ns);
+  output_resume_ns_[run_index] = resume_ns;
+#if defined(__linux__)
+  EpollDel(epoll_fd_, test->fd());
+#endif
+}
+
+size_t Isolate::ReadBatchMessages(size_t run_index) {
+  Batch* batch = &running_batches_[run_index];
   size_t finished_tests = 0;
-  int status;
-  pid_t pid;
-  while ((pid = TEMP_FAILURE_RETRY(waitpid(-1, &status, WNOHANG))) > 0) {
-    auto entry = running_by_pid_.find(pid);
-    if (entry == running_by_pid_.end()) {
-      LOG(FATAL) << "Pid " << pid << " was not spawned by the isolation framework.";
+  BatchMessage message;
+  ssize_t bytes;
+  while ((bytes = TEMP_FAILURE_RETRY(recv(batch->control_fd, &message, sizeof(message), 0))) ==
+         sizeof(message)) {
+    if (message.position != batch->position) {
+      LOG(FATAL) << "Batch reported test position " << message.position << ", expected "
+                 << batch->position;
+    }
+    if (message.type == BatchMessage::BATCH_TEST_START) {
+      batch->started = true;
+      if (batch->previous) {
+        finished_tests += FinishTest(std::move(batch->previous), batch->previous_status);
+      }
+      continue;
     }
 
-    std::unique_ptr<Test>& test_ptr = entry->second;
-    Test* test = test_ptr.get();
+    // The child flushed all output of this test before sending the message.
+    std::unique_ptr<Test>& test = running_by_pid_[batch->pid];
     test->Stop();
+    test->ReadAvailable();
+    int status = W_EXITCODE(message.failed ? 1 : 0, 0);
+    if (message.failed) {
+      batch->failed = true;
+    }
+    if (batch->position + 1 == batch->test_indices.size()) {
+      batch->ended = true;
+      batch->ended_status = status;
+    } else {
+      // The next test takes over the output pipe. A file stays open for the
+      // previous test as well, the output of the next test follows its output.
+      batch->previous = std::move(test);
+      batch->previous_status = status;
+      batch->position++;
+      batch->started = false;
+      size_t test_index = batch->test_indices[batch->position];
+      int fd;
+      if (batch->previous->output_in_file()) {
+        fd = fcntl(batch->previous->fd(), F_DUPFD_CLOEXEC, 0);
+        if (fd == -1) {
+          PLOG(FATAL) << "Unexpected failure from fcntl";
+        }
+      } else {
+        fd = batch->previous->ReleaseFd();
+      }
+      test.reset(new Test(tests_[test_index], test_index, run_index, fd));
+      // The child only starts the test once it gets the ack below.
+      if (options_.memory_control()) {
+        test->set_oom_kill_count(ReadOomKillCount());
+      }
+      test->set_output_limit(options_.output_limit_kb() * 1024);
+      if (!options_.output_dir().empty()) {
+        OpenLog(test.get());
+      }
+      if (batch->previous->output_in_file()) {
+        test->SetOutputFile(batch->previous->output_end());
+      }
+      running_[run_index] = test.get();
+      running_by_test_index_.erase(batch->previous->test_index());
+      running_by_test_index_[test_index] = test.get();
+      AddTimers(batch->pid, test.get());
+    }
+    // A failure means the child is gone, which is handled in CheckTestsFinished.
+    char ack = 0;
+    TEMP_FAILURE_RETRY(send(batch->control_fd, &ack, sizeof(ack), 0));
+  }
+  if (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    PLOG(FATAL) << "Unexpected failure from recv";
+  }
+  return finished_tests;
+}
 
-    // Read any leftover data.
-    test->ReadUntilClosed();
-    if (test->result() == TEST_NONE) {
-      if (WIFSIGNALED(status)) {
-        std::string output(test->name() + " terminated by signal: " + strsignal(WTERMSIG(status)) +
+size_t Isolate::CheckBatchesProgress() {
+  size_t finished_tests = 0;
+  for (size_t i = 0; i < running_batches_.size(); i++) {
+    if (running_batches_[i].control_fd != -1) {
+      finished_tests += ReadBatchMessages(i);
+    }
+  }
+  return finished_tests;
+}
+
+size_t Isolate::FinishTest(std::unique_ptr<Test> test, int status) {
+  test->FinishOutput();
+  // The test can end while its output is not read.
+  test->ResumeOutput(NanoTime());
+  size_t test_index = test->test_index();
+  if (test->oom_killed()) {
+    oom_killed_.insert(test_index);
+    size_t running = running_by_pid_.size() + 1;
+    if (running > 1) {
+      // Run it again later, with fewer tests competing for memory.
+      job_limit_ = std::min(job_limit_, running / 2);
+      printf("%s killed by the OOM killer, running it again with at most %s.\n",
+             test->name().c_str(), PluralizeString(job_limit_, " job").c_str());
+      pending_batches_.push_front(std::vector<size_t>{test_index});
+      return 0;
+    }
+  } else if (oom_killed_.count(test_index) != 0) {
+    test->set_oom_killed(true);
+  }
+
+  if (test->result() == TEST_NONE) {
+    if (WIFSIGNALED(status)) {
+      std::string output(test->name() + " terminated by signal: " + strsignal(WTERMSIG(status)) +
+                         ".\n");
+      test->AppendOutput(output);
+      test->set_result(TEST_FAIL);
+    } else {
+      int exit_code = WEXITSTATUS(status);
+      if (exit_code != 0) {
+        std::string output(test->name() + " exited with exitcode " + std::to_string(exit_code) +
                            ".\n");
         test->AppendOutput(output);
         test->set_result(TEST_FAIL);
       } else {
-        int exit_code = WEXITSTATUS(status);
-        if (exit_code != 0) {
-          std::string output(test->name() + " exited with exitcode " + std::to_string(exit_code) +
-                             ".\n");
-          test->AppendOutput(output);
-          test->set_result(TEST_FAIL);
-        } else {
-          // Set the result based on the output, since skipped tests and
-          // passing tests have the same exit status.
-          test->SetResultFromOutput();
-        }
+        // Set the result based on the output, since skipped tests and
+        // passing tests have the same exit status.
+        test->SetResultFromOutput();
       }
-    } else if (test->result() == TEST_TIMEOUT) {
-      uint64_t time_ms = options_.deadline_threshold_ms();
-      std::string timeout_str(test->name() + " killed because of timeout at " +
-                              std::to_string(time_ms) + " ms.\n");
-      test->AppendOutput(timeout_str);
     }
+  } else if (test->result() == TEST_TIMEOUT) {
+    uint64_t time_ms = options_.deadline_threshold_ms();
+    std::string timeout_str(test->name() + " killed because of timeout at " +
+                            std::to_string(time_ms) + " ms.\n");
+    test->AppendOutput(timeout_str);
+  }
+  if (test->output_paused_ns() != 0) {
+    std::string paused_str(test->name() + " wrote " + std::to_string(test->output_bytes()) +
+                           " bytes of output, reading it was paused for " +
+                           std::to_string(test->output_paused_ns() / kNsPerMs) +
+                           " ms to stay under " + std::to_string(options_.max_output_rate_kb()) +
+                           " KB per second.\n");
+    test->AppendOutput(paused_str);
+  }
 
-    if (test->ExpectFail()) {
-      if (test->result() == TEST_FAIL) {
-        // The test is expected to fail, it failed.
-        test->set_result(TEST_XFAIL);
-      } else if (test->result() == TEST_PASS) {
-        // The test is expected to fail, it passed.
-        test->set_result(TEST_XPASS);
-      }
+  if (test->ExpectFail()) {
+    if (test->result() == TEST_FAIL) {
+      // The test is expected to fail, it failed.
+      test->set_result(TEST_XFAIL);
+    } else if (test->result() == TEST_PASS) {
+      // The test is expected to fail, it passed.
+      test->set_result(TEST_XPASS);
     }
+  }
+
+  // Only the output of tests that failed is needed after it is printed. A
+  // log file is kept anyway, so the output is read from it again.
+  if (test->result() != TEST_PASS && test->result() != TEST_XFAIL && !test->output_in_log()) {
+    test->LoadOutput();
+  }
+
+  bool retry = (test->result() == TEST_FAIL || test->result() == TEST_TIMEOUT) &&
+               test->retry_count() < options_.retry_failed() && !failure_limit_reached_;
+  if (retry) {
+    std::string retry_str(test->name() + " will be run again (retry " +
+                          std::to_string(test->retry_count() + 1) + " of " +
+                          std::to_string(options_.retry_failed()) + ").\n");
+    test->AppendOutput(retry_str);
+  }
 
+  bool failed = test->result() == TEST_FAIL || test->result() == TEST_TIMEOUT;
+  if (options_.dedupe_failures() && failed) {
+    FailureHasher hasher;
+    test->ReadOutputAs("TEST",
+                       [&hasher](const char* data, size_t size) { hasher.Add(data, size); });
+    // Zero means no fingerprint.
+    test->set_fingerprint(hasher.hash() | 1);
+  }
+
+  if (enumerating_) {
+    held_results_.push_back(test.get());
+  } else {
     test->Print(options_.gtest_format());
+    if (!KeepOutput(*test)) {
+      test->DropOutput();
+    }
+  }
+
+  if (options_.dedupe_failures() && failed) {
+    ShareOutput(test.get());
+  }
+  SpoolOutput(test.get());
+  CompressOutput(test.get());
+
+  if (retry) {
+    retry_tests_.push_back(test_index);
+    failed_attempts_[test_index].push_back(std::move(test));
+    return 0;
+  }
+
+  AddResult(test_index, std::move(test));
+  return 1;
+}
+
+void Isolate::AddResult(size_t test_index, std::unique_ptr<Test> test) {
+  CountResult(*test);
+  WriteXmlTest(*test);
+  finished_.emplace(test_index, std::move(test));
+}
+
+void Isolate::CountResult(const Test& test) {
+  switch (test.result()) {
+    case TEST_PASS:
+      total_pass_tests_++;
+      if (test.slow()) {
+        total_slow_tests_++;
+      }
+      if (test.retry_count() != 0) {
+        total_flaky_tests_++;
+      }
+      break;
+    case TEST_XPASS:
+      total_xpass_tests_++;
+      break;
+    case TEST_FAIL:
+      total_fail_tests_++;
+      break;
+    case TEST_TIMEOUT:
+      total_timeout_tests_++;
+      break;
+    case TEST_XFAIL:
+      total_xfail_tests_++;
+      break;
+    case TEST_SKIPPED:
+      total_skipped_tests_++;
+      break;
+    case TEST_NOT_RUN:
+      total_not_run_tests_++;
+      break;
+    case TEST_NONE:
+      LOG(FATAL) << "Test result is TEST_NONE, this should not be possible.";
+  }
+  if (test.oom_killed()) {
+    total_oom_tests_++;
+  }
+}
 
-    switch (test->result()) {
-      case TEST_PASS:
-        total_pass_tests_++;
-        if (test->slow()) {
-          total_slow_tests_++;
+void Isolate::CountResults() {
+  total_pass_tests_ = 0;
+  total_xpass_tests_ = 0;
+  total_fail_tests_ = 0;
+  total_xfail_tests_ = 0;
+  total_timeout_tests_ = 0;
+  total_slow_tests_ = 0;
+  total_skipped_tests_ = 0;
+  total_oom_tests_ = 0;
+  total_not_run_tests_ = 0;
+  total_flaky_tests_ = 0;
+  for (const auto& entry : finished_) {
+    CountResult(*entry.second);
+  }
+}
+
+size_t Isolate::FinishBatch(std::unique_ptr<Test> test, int status) {
+  size_t run_index = test->run_index();
+  Batch* batch = &running_batches_[run_index];
+#if defined(__linux__)
+  EpollDel(epoll_fd_, batch->control_fd);
+#endif
+
+  size_t finished_tests = 0;
+  std::vector<size_t> unresolved;
+  if (batch->ended && test->result() != TEST_TIMEOUT) {
+    // Every test reported its result, they only stand if the child exited
+    // the way gtest would after running them.
+    if (WIFEXITED(status) && WEXITSTATUS(status) == (batch->failed ? 1 : 0)) {
+      finished_tests += FinishTest(std::move(test), batch->ended_status);
+    } else {
+      unresolved.push_back(test->test_index());
+    }
+  } else if (batch->started || test->result() == TEST_TIMEOUT) {
+    // The running test caused the exit, the tests after it never ran.
+    if (batch->previous) {
+      finished_tests += FinishTest(std::move(batch->previous), batch->previous_status);
+    }
+    finished_tests += FinishTest(std::move(test), status);
+    std::vector<size_t> rest(batch->test_indices.begin() + batch->position + 1,
+                             batch->test_indices.end());
+    if (!rest.empty()) {
+      pending_batches_.push_front(std::move(rest));
+    }
+  } else {
+    // The child exited between two tests, which could have been caused by
+    // either of them or by any test suite setup or teardown.
+    if (batch->previous) {
+      unresolved.push_back(batch->previous->test_index());
+    }
+    unresolved.insert(unresolved.end(), batch->test_indices.begin() + batch->position,
+                      batch->test_indices.end());
+  }
+
+  // Bisect the tests that could have caused the exit, a single test runs
+  // by itself so the exit is attributed to it.
+  if (unresolved.size() > 1) {
+    size_t half = unresolved.size() / 2;
+    pending_batches_.emplace_front(unresolved.begin() + half, unresolved.end());
+    pending_batches_.emplace_front(unresolved.begin(), unresolved.begin() + half);
+  } else if (!unresolved.empty()) {
+    pending_batches_.push_front(std::move(unresolved));
+  }
+
+  running_batches_[run_index] = Batch();
+  return finished_tests;
+}
+
+uint64_t Isolate::ReadOomKillCount() const {
+  return ReadProcValue(oom_kill_file_.c_str(), "oom_kill ", 0);
+}
+
+bool Isolate::ClaimOomKill(const Test& test) {
+  // Only a kill counted while the test ran can have killed it, and every
+  // kill is attributed to at most one test. Kills no test claimed are not
+  // kept for later tests.
+  uint64_t claimed = std::max(test.oom_kill_count(), oom_kills_claimed_);
+  if (ReadOomKillCount() <= claimed) {
+    return false;
+  }
+  oom_kills_claimed_ = claimed + 1;
+  return true;
+}
+
+size_t Isolate::CheckTestsFinished() {
+  size_t finished_tests = 0;
+  int status;
+  rusage usage;
+  pid_t pid;
+  while ((pid = TEMP_FAILURE_RETRY(wait4(-1, &status, WNOHANG, &usage))) > 0) {
+    auto entry = running_by_pid_.find(pid);
+    if (entry == running_by_pid_.end()) {
+      auto prefork = std::find_if(preforked_.begin(), preforked_.end(),
+                                  [pid](const Prefork& child) { return child.pid == pid; });
+      if (prefork != preforked_.end()) {
+        // A preforked child died before it was used.
+        preforked_.erase(prefork);
+        continue;
+      }
+      auto listing = std::find_if(listings_.begin(), listings_.end(),
+                                  [pid](const Listing& listing) { return listing.pid == pid; });
+      if (listing != listings_.end()) {
+        // A binary finished listing its tests, the rest of its output is
+        // read by StreamTests.
+        listing->pid = 0;
+        continue;
+      }
+#if defined(__linux__)
+      if (fork_server_fd_ != -1) {
+        // As a subreaper this process also inherits processes orphaned by tests.
+        continue;
+      }
+#endif
+      LOG(FATAL) << "Pid " << pid << " was not spawned by the isolation framework.";
+    }
+
+    size_t run_index = entry->second->run_index();
+    const Batch& batch = running_batches_[run_index];
+    if (batch.control_fd != -1) {
+      // Handle anything the child reported before exiting.
+      finished_tests += ReadBatchMessages(run_index);
+    }
+    std::unique_ptr<Test> test(std::move(entry->second));
+    running_by_pid_.erase(entry);
+    if (!batch.ended) {
+      test->Stop();
+    }
+#if defined(__APPLE__)
+    test->set_peak_rss_kb(usage.ru_maxrss / 1024);
+#else
+    test->set_peak_rss_kb(usage.ru_maxrss);
+#endif
+    // A test killed because of the failure limit is reported as not run.
+    bool killed =
+        killed_pids_.erase(pid) != 0 && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+    if (!killed && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL &&
+        test->result() != TEST_TIMEOUT && options_.memory_control() && ClaimOomKill(*test)) {
+      test->set_oom_killed(true);
+    }
+
+#if defined(__linux__)
+    if (test->fd() != -1 && !test->output_in_file() && output_resume_ns_[run_index] == 0) {
+      EpollDel(epoll_fd_, test->fd());
+    }
+    android::base::unique_fd& pidfd = running_pidfds_[run_index];
+    if (pidfd != -1) {
+      EpollDel(epoll_fd_, pidfd);
+      pidfd.reset();
+    }
+#endif
+
+    // Read any leftover data.
+    test->ReadUntilClosed();
+
+    size_t test_index = test->test_index();
+    if (killed) {
+      if (batch.control_fd != -1) {
+        Batch* killed_batch = &running_batches_[run_index];
+#if defined(__linux__)
+        EpollDel(epoll_fd_, killed_batch->control_fd);
+#endif
+        // The previous test of the batch ended before the kill.
+        if (killed_batch->previous) {
+          finished_tests +=
+              FinishTest(std::move(killed_batch->previous), killed_batch->previous_status);
         }
-        break;
-      case TEST_XPASS:
-        total_xpass_tests_++;
-        break;
-      case TEST_FAIL:
-        total_fail_tests_++;
-        break;
-      case TEST_TIMEOUT:
-        total_timeout_tests_++;
-        break;
-      case TEST_XFAIL:
-        total_xfail_tests_++;
-        break;
-      case TEST_SKIPPED:
-        total_skipped_tests_++;
-        break;
-      case TEST_NONE:
-        LOG(FATAL) << "Test result is TEST_NONE, this should not be possible.";
+        running_batches_[run_index] = Batch();
+      }
+    } else if (batch.control_fd != -1) {
+      finished_tests += FinishBatch(std::move(test), status);
+    } else {
+      finished_tests += FinishTest(std::move(test), status);
     }
-    finished_tests++;
-    size_t test_index = test->test_index();
-    finished_.emplace(test_index, test_ptr.release());
-    running_indices_.push_back(test->run_index());
+    running_indices_.push_back(run_index);
 
     // Remove it from all of the running indices.
-    size_t run_index = test->run_index();
-    if (running_by_pid_.erase(pid) != 1) {
-      printf("Internal error: Erasing pid %d from running_by_pid_ incorrect\n", pid);
-    }
     if (running_by_test_index_.erase(test_index) == 0) {
       printf("Internal error: Erasing test_index %zu from running_by_pid_ incorrect\n", test_index);
     }
     running_[run_index] = nullptr;
-    running_pollfds_[run_index] = {};
+    running_pollfds_[run_index] = {.fd = -1};
+    output_resume_ns_[run_index] = 0;
   }
 
   // The only valid error case is if ECHILD is returned because there are
   // no more processes left running.
   if (pid == -1 && errno != ECHILD) {
-    PLOG(FATAL) << "Unexpected failure from waitpid";
+    PLOG(FATAL) << "Unexpected failure from wait4";
   }
   return finished_tests;
 }
 
+void Isolate::AddTimers(pid_t pid, const Test* test) {
+  uint64_t start_ns = test->start_ns();
+  size_t test_index = test->test_index();
+  timers_.push(TestTimer{start_ns + deadline_threshold_ns_, true, pid, test_index, start_ns});
+  timers_.push(TestTimer{start_ns + slow_threshold_ns_, false, pid, test_index, start_ns});
+}
+
+Test* Isolate::TimerTest(const TestTimer& timer) {
+  auto entry = running_by_pid_.find(timer.pid);
+  if (entry == running_by_pid_.end()) {
+    return nullptr;
+  }
+  Test* test = entry->second.get();
+  if (test->test_index() != timer.test_index || test->start_ns() != timer.start_ns ||
+      test->result() == TEST_TIMEOUT || (!timer.deadline && test->slow())) {
+    return nullptr;
+  }
+  return test;
+}
+
+uint64_t Isolate::NextTimerNs() {
+  // Drop the timers of tests that are gone, so that they do not wake up the loop.
+  while (!timers_.empty() && TimerTest(timers_.top()) == nullptr) {
+    timers_.pop();
+  }
+  return timers_.empty() ? UINT64_MAX : timers_.top().time_ns;
+}
+
 void Isolate::CheckTestsTimeout() {
-  for (auto& entry : running_by_pid_) {
-    Test* test = entry.second.get();
-    if (test->result() == TEST_TIMEOUT) {
+  // Only the timers that expired are looked at, not every running test.
+  uint64_t now_ns = NanoTime();
+  while (!timers_.empty() && timers_.top().time_ns < now_ns) {
+    TestTimer timer = timers_.top();
+    timers_.pop();
+    Test* test = TimerTest(timer);
+    if (test == nullptr) {
       continue;
     }
 
-    if (NanoTime() > test->start_ns() + deadline_threshold_ns_) {
+    if (timer.deadline) {
       test->set_result(TEST_TIMEOUT);
       // Do not mark this as slow and timed out.
       test->set_slow(false);
       // Test gets cleaned up in CheckTestsFinished.
-      kill(entry.first, SIGKILL);
-    } else if (!test->slow() && NanoTime() > test->start_ns() + slow_threshold_ns_) {
+      kill(timer.pid, SIGKILL);
+    } else {
       // Mark the test as running slow.
       test->set_slow(true);
     }
@@ -380,54 +1936,355 @@ void Isolate::HandleSignals() {
     for (auto& entry : running_by_pid_) {
       kill(entry.first, SIGKILL);
     }
+    for (const auto& child : preforked_) {
+      kill(child.pid, SIGKILL);
+    }
+    // Keep the results of the tests that finished.
+    FlushXmlFiles(UINT64_MAX);
     exit(1);
   } else if (signal == SIGQUIT) {
     printf("List of current running tests:\n");
     for (const auto& entry : running_by_test_index_) {
       const Test* test = entry.second;
       uint64_t run_time_ms = (NanoTime() - test->start_ns()) / kNsPerMs;
-      printf("  %s (elapsed time %" PRId64 " ms)\n", test->name().c_str(), run_time_ms);
+      printf("  %s (elapsed time %" PRId64 " ms", test->name().c_str(), run_time_ms);
+      if (test->output_reads() != 0) {
+        printf(", %" PRIu64 " bytes of output in %s", test->output_bytes(),
+               PluralizeString(test->output_reads(), " read").c_str());
+      }
+      printf(")\n");
     }
   }
 }
 
 void Isolate::RunAllTests() {
-  total_pass_tests_ = 0;
-  total_xpass_tests_ = 0;
-  total_fail_tests_ = 0;
-  total_xfail_tests_ = 0;
-  total_timeout_tests_ = 0;
-  total_slow_tests_ = 0;
-  total_skipped_tests_ = 0;
-
   running_by_test_index_.clear();
+  pending_batches_.clear();
+  timers_ = decltype(timers_)();
 
   size_t job_count = options_.job_count();
   running_.clear();
   running_.resize(job_count);
-  running_pollfds_.resize(job_count);
-  memset(running_pollfds_.data(), 0, running_pollfds_.size() * sizeof(pollfd));
+  running_pollfds_.assign(job_count, {.fd = -1});
+  output_resume_ns_.assign(job_count, 0);
+  running_batches_.clear();
+  running_batches_.resize(job_count);
+#if defined(__linux__)
+  running_pidfds_.clear();
+  running_pidfds_.resize(job_count);
+#endif
   running_indices_.clear();
   for (size_t i = 0; i < job_count; i++) {
     running_indices_.push_back(i);
   }
+  job_limit_ = job_count;
+  memory_check_ns_ = 0;
+  oom_kills_claimed_ = 0;
+  oom_killed_.clear();
+  failure_limit_reached_ = false;
+  killed_pids_.clear();
 
   finished_.clear();
+  failed_attempts_.clear();
+  retry_tests_.clear();
+  if (spool_fd_ != -1) {
+    if (ftruncate(spool_fd_, 0) == -1 || lseek(spool_fd_, 0, SEEK_SET) == -1) {
+      PLOG(FATAL) << "Unexpected failure emptying the spool file";
+    }
+    spool_size_ = 0;
+  }
+  shared_outputs_.clear();
+  compress_ns_ = 0;
+  uncompressed_bytes_ = 0;
+  compressed_bytes_ = 0;
+  CountResults();
+  first_launch_ns_ = 0;
+
+#if defined(__linux__)
+  for (size_t i = cur_listing_; enumerating_ && i < listings_.size(); i++) {
+    EpollAdd(epoll_fd_, listings_[i].fd, EVENT_LISTING, i);
+    listings_[i].polled = true;
+  }
+#endif
 
   size_t finished = 0;
   cur_test_index_ = 0;
-  while (finished < tests_.size()) {
+  while (enumerating_ ||
+         (failure_limit_reached_ ? !running_by_pid_.empty() : finished < tests_.size())) {
+    if (enumerating_) {
+      StreamTests();
+      if (!enumerating_) {
+        // All tests are listed, which can mean that all of them finished.
+        continue;
+      }
+    }
+
     LaunchTests();
 
+    // Nothing can wake up the loop without a running test or a listing.
+    if (running_by_pid_.empty() && !enumerating_) {
+      continue;
+    }
+    WaitForEvents();
+
     ReadTestsOutput();
 
+    finished += CheckBatchesProgress();
+
     finished += CheckTestsFinished();
 
     CheckTestsTimeout();
 
+    FlushXmlFiles(NanoTime());
+
     HandleSignals();
 
-    usleep(MIN_USECONDS_WAIT);
+    if (!failure_limit_reached_ && FailureLimitReached()) {
+      StopLaunchingTests();
+    }
+  }
+  ReleasePreforked();
+
+  if (failure_limit_reached_) {
+    // Report every test that did not finish, so the totals still add up.
+    for (size_t i = 0; i < tests_.size(); i++) {
+      if (finished_.count(i) == 0) {
+        std::unique_ptr<Test> test(new Test(tests_[i], i, 0, -1));
+        test->Stop();
+        test->set_result(TEST_NOT_RUN);
+        AddResult(i, std::move(test));
+      }
+    }
+  }
+}
+
+bool Isolate::FailureLimitReached() const {
+  size_t failures = total_fail_tests_ + total_timeout_tests_ + total_xpass_tests_;
+  if (failures == 0) {
+    return false;
+  }
+  if (options_.fail_fast()) {
+    return true;
+  }
+  if (options_.max_failures() != 0 && failures > options_.max_failures()) {
+    return true;
+  }
+  // The ratio is of all tests, which are only known once they are listed.
+  if (options_.max_failure_ratio() == 0 || enumerating_) {
+    return false;
+  }
+  return failures > options_.max_failure_ratio() * tests_.size();
+}
+
+void Isolate::StopLaunchingTests() {
+  failure_limit_reached_ = true;
+  // The tests of crashed batches are not run again either, and the failed
+  // tests keep the result of their last run.
+  pending_batches_.clear();
+  for (size_t test_index : retry_tests_) {
+    std::vector<std::unique_ptr<Test>>& attempts = failed_attempts_[test_index];
+    std::unique_ptr<Test> test(std::move(attempts.back()));
+    attempts.pop_back();
+    if (attempts.empty()) {
+      failed_attempts_.erase(test_index);
+    }
+    AddResult(test_index, std::move(test));
+  }
+  retry_tests_.clear();
+  size_t running = running_by_pid_.size();
+  if (running == 0) {
+    printf("Failure limit reached, no more tests are launched.\n");
+  } else if (options_.kill_on_failure_limit()) {
+    printf("Failure limit reached, killing %s.\n",
+           PluralizeString(running, " running test").c_str());
+    for (const auto& entry : running_by_pid_) {
+      kill(entry.first, SIGKILL);
+      killed_pids_.insert(entry.first);
+    }
+  } else {
+    printf("Failure limit reached, waiting for %s to finish.\n",
+           PluralizeString(running, " running test").c_str());
+  }
+  fflush(stdout);
+}
+
+void Isolate::CreateSpool() {
+  const char* tmp_dir = getenv("TMPDIR");
+  if (tmp_dir == nullptr) {
+#if defined(__ANDROID__)
+    tmp_dir = "/data/local/tmp";
+#else
+    tmp_dir = "/tmp";
+#endif
+  }
+  std::string path(std::string(tmp_dir) + "/gtest_spool.XXXXXX");
+  spool_fd_.reset(mkstemp(&path[0]));
+  if (spool_fd_ == -1) {
+    PLOG(FATAL) << "Unable to create the spool file " << path;
+  }
+  // Nothing else needs the file, it goes away with the fd.
+  unlink(path.c_str());
+  if (fcntl(spool_fd_, F_SETFD, FD_CLOEXEC) == -1) {
+    PLOG(FATAL) << "Unexpected failure from fcntl";
+  }
+}
+
+static void MakeDirectory(const std::string& dir) {
+  if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+    PLOG(FATAL) << "Unable to create the directory " << dir;
+  }
+}
+
+// Test names can have '/' in them, which cannot be in a file name.
+static std::string LogFileName(const std::string& name) {
+  std::string file_name(name);
+  std::replace(file_name.begin(), file_name.end(), '/', '_');
+  return file_name;
+}
+
+void Isolate::OpenLog(Test* test) {
+  std::string dir(options_.output_dir());
+  if (binaries_.size() > 1) {
+    dir += '/' + binaries_[BinaryIndex(test->test_index())].name;
+  }
+  // The suite name ends with a '.'.
+  const std::string& suite_name = test->suite_name();
+  dir += '/' + LogFileName(suite_name.substr(0, suite_name.size() - 1));
+  if (log_dirs_.insert(dir).second) {
+    MakeDirectory(options_.output_dir());
+    if (binaries_.size() > 1) {
+      MakeDirectory(dir.substr(0, dir.rfind('/')));
+    }
+    MakeDirectory(dir);
+  }
+
+  std::string path(dir + '/' + LogFileName(test->test_name()) + '.' + std::to_string(iteration_));
+  if (test->retry_count() != 0) {
+    path += ".retry" + std::to_string(test->retry_count());
+  }
+  path += ".log";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    PLOG(FATAL) << "Unable to create the log file " << path;
+  }
+  test->SetLogFile(fd, path);
+}
+
+bool Isolate::KeepOutput(const Test& test) const {
+  const std::string& keep_output = options_.keep_output();
+  if (keep_output == "failures") {
+    return test.result() != TEST_PASS && test.result() != TEST_XFAIL &&
+           test.result() != TEST_SKIPPED;
+  }
+  return keep_output == "all";
+}
+
+void Isolate::SpoolOutput(Test* test) {
+  if (spool_fd_ == -1 || test->output_in_file() ||
+      test->output().size() <= options_.spool_threshold_kb() * 1024) {
+    return;
+  }
+  const std::string& output = test->output();
+  if (!android::base::WriteFully(spool_fd_, output.data(), output.size())) {
+    PLOG(FATAL) << "Unexpected failure writing the spool file";
+  }
+  test->SpoolOutput(spool_fd_, spool_size_);
+  spool_size_ += output.size();
+}
+
+void Isolate::ShareOutput(Test* test) {
+  // Only output in memory is compared, which is where the output of
+  // failed tests ends up unless it is in a log file.
+  const std::string& output = test->output();
+  if (output.empty() || test->output_in_file()) {
+    return;
+  }
+  uint64_t hash = HashString(
+      android::base::StringReplace(output, test->name(), std::string(1, '\0'), true));
+  auto entry = shared_outputs_.find(hash);
+  if (entry == shared_outputs_.end()) {
+    shared_outputs_.emplace(hash, test);
+    return;
+  }
+
+  // Make sure the output is the same, not only the hash.
+  const Test* original = entry->second;
+  size_t pos = 0;
+  bool same = true;
+  original->ReadOutputAs(test->name(), [&](const char* data, size_t size) {
+    same = same && output.compare(pos, size, data, size) == 0;
+    pos += size;
+  });
+  if (same && pos == output.size()) {
+    test->ShareOutput(original);
+  }
+}
+
+void Isolate::CompressOutput(Test* test) {
+  if (!options_.compress_output()) {
+    return;
+  }
+  uint64_t start_ns = NanoTime();
+  test->CompressOutput();
+  const CompressedOutput* compressed = test->compressed_output();
+  if (compressed != nullptr) {
+    compress_ns_ += NanoTime() - start_ns;
+    uncompressed_bytes_ += compressed->size();
+    compressed_bytes_ += compressed->compressed_size();
+  }
+}
+
+void Isolate::StreamTests() {
+  bool listed = ReadListings();
+  // The tests are launched in the order they are listed.
+  while (test_order_.size() < tests_.size()) {
+    test_order_.push_back(test_order_.size());
+  }
+  if (!listed) {
+    return;
+  }
+  enumerating_ = false;
+  listed_ns_ = NanoTime();
+#if defined(__linux__)
+  if (options_.fork_server()) {
+    StartForkServer();
+  }
+#endif
+  PrintHeader();
+  for (Test* test : held_results_) {
+    test->Print(options_.gtest_format());
+    if (!KeepOutput(*test)) {
+      test->DropOutput();
+    }
+  }
+  held_results_.clear();
+}
+
+void Isolate::PrintFailureGroups() {
+  // The first test of every group, and the size of the group.
+  std::vector<std::pair<const Test*, size_t>> groups;
+  std::unordered_map<uint64_t, size_t> group_indices;
+  for (const auto& entry : finished_) {
+    const Test* test = entry.second.get();
+    if (test->fingerprint() == 0) {
+      continue;
+    }
+    auto index = group_indices.emplace(test->fingerprint(), groups.size());
+    if (index.second) {
+      groups.emplace_back(test, 1);
+    } else {
+      groups[index.first->second].second++;
+    }
+  }
+
+  for (const auto& group : groups) {
+    if (group.second == 1) {
+      continue;
+    }
+    ColoredPrintf(COLOR_RED, "[  FAILED  ]");
+    printf(" %s failed the same way as %s:\n", PluralizeString(group.second, " test").c_str(),
+           group.first->name().c_str());
+    group.first->ReadOutput([](const char* data, size_t size) { fwrite(data, 1, size, stdout); });
   }
 }
 
@@ -474,6 +2331,29 @@ Isolate::ResultsType Isolate::SlowResults = {
         },
 };
 
+Isolate::ResultsType Isolate::OomResults = {
+    .color = COLOR_YELLOW,
+    .prefix = "[  OOM     ]",
+    .list_desc = "killed by the OOM killer",
+    .title = "OOM KILLED",
+    .match_func = [](const Test& test) { return test.oom_killed(); },
+    .print_func = nullptr,
+};
+
+Isolate::ResultsType Isolate::FlakyResults = {
+    .color = COLOR_YELLOW,
+    .prefix = "[  FLAKY   ]",
+    .list_desc = "passed after failing",
+    .title = "FLAKY",
+    .match_func = [](const Test& test) {
+      return test.result() == TEST_PASS && test.retry_count() != 0;
+    },
+    .print_func =
+        [](const Options&, const Test& test) {
+          printf(" (passed on run %zu)", test.retry_count() + 1);
+        },
+};
+
 Isolate::ResultsType Isolate::XpassFailResults = {
     .color = COLOR_RED,
     .prefix = "[  FAILED  ]",
@@ -513,12 +2393,52 @@ Isolate::ResultsType Isolate::SkippedResults = {
     .print_func = nullptr,
 };
 
-void Isolate::PrintFooter(uint64_t elapsed_time_ns) {
+Isolate::ResultsType Isolate::NotRunResults = {
+    .color = COLOR_YELLOW,
+    .prefix = "[  NOT RUN ]",
+    .list_desc = "not run because of the failure limit",
+    .title = "NOT RUN",
+    .match_func = [](const Test& test) { return test.result() == TEST_NOT_RUN; },
+    .print_func = nullptr,
+};
+
+void Isolate::PrintHeader() {
+  ColoredPrintf(COLOR_GREEN, "[==========]");
+  printf(" Running %s from %s", PluralizeString(total_tests_, " test").c_str(),
+         PluralizeString(total_suites_, " test suite").c_str());
+  if (binaries_.size() > 1) {
+    printf(" in %zu binaries", binaries_.size());
+  }
+  printf(" (%s).\n", PluralizeString(options_.job_count(), " job").c_str());
+  fflush(stdout);
+}
+
+void Isolate::PrintFooter(uint64_t elapsed_time_ns, bool print_startup_time) {
   ColoredPrintf(COLOR_GREEN, "[==========]");
   printf(" %s from %s ran. (%" PRId64 " ms total)\n",
          PluralizeString(total_tests_, " test").c_str(),
          PluralizeString(total_suites_, " test suite").c_str(), elapsed_time_ns / kNsPerMs);
 
+  // Listing the tests of a binary can take longer than running them, so
+  // report how long the jobs were idle at the start.
+  if (print_startup_time && !listings_.empty() && first_launch_ns_ != 0) {
+    ColoredPrintf(COLOR_GREEN, "[==========]");
+    printf(" First test started after %" PRIu64 " ms",
+           (first_launch_ns_ - run_start_ns_) / kNsPerMs);
+    if (listed_ns_ > run_start_ns_) {
+      printf(", all tests listed after %" PRIu64 " ms", (listed_ns_ - run_start_ns_) / kNsPerMs);
+    }
+    printf(".\n");
+  }
+
+  if (print_startup_time && compressed_bytes_ != 0) {
+    ColoredPrintf(COLOR_GREEN, "[==========]");
+    printf(" Compressed %" PRIu64 " bytes of output to %" PRIu64 " bytes (%.1fx) in %" PRIu64
+           " ms.\n",
+           uncompressed_bytes_, compressed_bytes_,
+           static_cast<double>(uncompressed_bytes_) / compressed_bytes_, compress_ns_ / kNsPerMs);
+  }
+
   ColoredPrintf(COLOR_GREEN, "[  PASSED  ]");
   printf(" %s.", PluralizeString(total_pass_tests_ + total_xfail_tests_, " test").c_str());
   if (total_xfail_tests_ != 0) {
@@ -538,6 +2458,16 @@ void Isolate::PrintFooter(uint64_t elapsed_time_ns) {
     PrintResults(total_slow_tests_, SlowResults, &footer);
   }
 
+  // Tests that were killed by the OOM killer at least once.
+  if (total_oom_tests_ != 0) {
+    PrintResults(total_oom_tests_, OomResults, &footer);
+  }
+
+  // Tests that failed and then passed when run again.
+  if (total_flaky_tests_ != 0) {
+    PrintResults(total_flaky_tests_, FlakyResults, &footer);
+  }
+
   // Tests that passed but should have failed.
   if (total_xpass_tests_ != 0) {
     PrintResults(total_xpass_tests_, XpassFailResults, &footer);
@@ -553,6 +2483,15 @@ void Isolate::PrintFooter(uint64_t elapsed_time_ns) {
     PrintResults(total_fail_tests_, FailResults, &footer);
   }
 
+  // Tests that were not run because too many tests failed.
+  if (total_not_run_tests_ != 0) {
+    PrintResults(total_not_run_tests_, NotRunResults, &footer);
+  }
+
+  if (options_.dedupe_failures()) {
+    PrintFailureGroups();
+  }
+
   if (!footer.empty()) {
     printf("\n%s", footer.c_str());
   }
@@ -568,34 +2507,176 @@ void Isolate::PrintFooter(uint64_t elapsed_time_ns) {
   fflush(stdout);
 }
 
-std::string XmlEscape(const std::string& xml) {
-  std::string escaped;
-  escaped.reserve(xml.size());
+void Isolate::ReportBinaries(time_t start_time) {
+  std::map<size_t, std::unique_ptr<Test>> all_finished(std::move(finished_));
+  size_t total_tests = total_tests_;
+  size_t total_suites = total_suites_;
+  size_t total_disable_tests = total_disable_tests_;
+  for (size_t i = 0; i < binaries_.size(); i++) {
+    const Binary& binary = binaries_[i];
+    // The time from the start of the first test to the end of the last one.
+    uint64_t start_ns = UINT64_MAX;
+    uint64_t end_ns = 0;
+    finished_.clear();
+    for (auto entry = all_finished.lower_bound(binary.tests_begin);
+         entry != all_finished.end() && entry->first < binary.tests_end; ++entry) {
+      const Test* test = entry->second.get();
+      if (test->result() != TEST_NOT_RUN) {
+        start_ns = std::min(start_ns, test->start_ns());
+        end_ns = std::max(end_ns, test->start_ns() + test->RunTimeNs());
+      }
+      finished_.emplace(entry->first, std::move(entry->second));
+    }
+    CountResults();
+    total_tests_ = binary.tests_end - binary.tests_begin;
+    total_suites_ = binary.total_suites;
+    total_disable_tests_ = binary.total_disable_tests;
+    uint64_t elapsed_time_ns = end_ns > start_ns ? end_ns - start_ns : 0;
 
-  for (auto c : xml) {
-    switch (c) {
-      case '<':
-        escaped.append("&lt;");
-        break;
-      case '>':
-        escaped.append("&gt;");
-        break;
-      case '&':
-        escaped.append("&amp;");
-        break;
-      case '\'':
-        escaped.append("&apos;");
-        break;
-      case '"':
-        escaped.append("&quot;");
-        break;
-      default:
-        escaped.append(1, c);
-        break;
+    printf("\n");
+    ColoredPrintf(COLOR_GREEN, "[==========]");
+    printf(" %s\n", binary.args[0]);
+    PrintFooter(elapsed_time_ns, false);
+    if (!binary.xml_file.empty()) {
+      WriteXmlResults(i, elapsed_time_ns, start_time);
+    }
+
+    for (auto& entry : finished_) {
+      all_finished[entry.first] = std::move(entry.second);
+    }
+  }
+
+  finished_ = std::move(all_finished);
+  CountResults();
+  total_tests_ = total_tests;
+  total_suites_ = total_suites;
+  total_disable_tests_ = total_disable_tests;
+  printf("\n");
+}
+
+static std::string XmlTimestamp(time_t start_time) {
+  const tm* time_struct = localtime(&start_time);
+  if (time_struct == nullptr) {
+    PLOG(FATAL) << "Unexpected failure from localtime";
+  }
+  char timestamp[40];
+  snprintf(timestamp, sizeof(timestamp), "%4d-%02d-%02dT%02d:%02d:%02d",
+           time_struct->tm_year + 1900, time_struct->tm_mon + 1, time_struct->tm_mday,
+           time_struct->tm_hour, time_struct->tm_min, time_struct->tm_sec);
+  return timestamp;
+}
+
+void Isolate::OpenXmlFiles(time_t start_time) {
+  xml_writers_.clear();
+  xml_ranges_.clear();
+  xml_output_cache_.clear();
+  std::string header(android::base::StringPrintf(
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<testsuites timestamp=\"%s\" name=\"AllTests\">\n",
+      XmlTimestamp(start_time).c_str()));
+  for (const auto& binary : binaries_) {
+    if (binary.xml_file.empty()) {
+      xml_writers_.emplace_back();
+      continue;
+    }
+    std::unique_ptr<XmlWriter> writer(new XmlWriter);
+    if (!writer->Open(binary.xml_file, "</testsuites>\n")) {
+      printf("Cannot open xml file '%s': %s\n", binary.xml_file.c_str(), strerror(errno));
+      exit(1);
+    }
+    writer->Append(header);
+    writer->Flush();
+    xml_writers_.push_back(std::move(writer));
+  }
+}
+
+void Isolate::FlushXmlFiles(uint64_t now_ns) {
+  for (auto& writer : xml_writers_) {
+    if (writer && now_ns >= writer->flush_ns()) {
+      writer->Flush();
+    }
+  }
+}
+
+// Writes the escaped output of a test piece by piece, so that output that
+// is in a file is never all in memory. Output that is shared by several
+// tests is only escaped once.
+void Isolate::WriteXmlOutput(XmlWriter* writer, const Test& test) {
+  // The output of results that are printed later is not dropped yet.
+  if (!KeepOutput(test)) {
+    return;
+  }
+  const Test* original = test.shared_output();
+  if (original != nullptr) {
+    auto entry = xml_output_cache_.find(original);
+    if (entry == xml_output_cache_.end()) {
+      std::string escaped;
+      original->ReadOutput(
+          [&escaped](const char* data, size_t size) { XmlEscape(data, size, &escaped); });
+      entry = xml_output_cache_.emplace(original, std::move(escaped)).first;
     }
+    writer->Append(android::base::StringReplace(entry->second, XmlEscape(original->name()),
+                                                XmlEscape(test.name()), true));
+    return;
+  }
+  test.ReadOutput(
+      [writer](const char* data, size_t size) { writer->AppendEscaped(data, size); });
+}
+
+void Isolate::WriteXmlTest(const Test& test) {
+  if (xml_writers_.empty() || test.result() == TEST_XFAIL) {
+    // Skip XFAIL tests.
+    return;
+  }
+  XmlWriter* writer = xml_writers_[BinaryIndex(test.test_index())].get();
+  if (writer == nullptr) {
+    return;
   }
 
-  return escaped;
+  const std::string& suite_name = test.suite_name();
+  std::string name(suite_name.substr(0, suite_name.size() - 1));
+  bool run = test.result() != TEST_NOT_RUN;
+  double time_ms = double(test.RunTimeNs()) / kNsPerMs;
+  // The test is in a suite of its own until all tests finished, so that
+  // the file is complete at any time.
+  writer->Append(android::base::StringPrintf(
+      "  <testsuite name=\"%s\" tests=\"1\" failures=\"%d\" disabled=\"0\" errors=\"0\""
+      " time=\"%.3lf\">\n",
+      name.c_str(), run && test.result() != TEST_PASS, time_ms));
+  off_t begin = writer->offset();
+  writer->Append(android::base::StringPrintf(
+      "    <testcase name=\"%s\" status=\"%s\" time=\"%.3lf\" classname=\"%s\"",
+      test.test_name().c_str(), run ? "run" : "notrun", time_ms, name.c_str()));
+  auto attempts = failed_attempts_.find(test.test_index());
+  if (test.result() == TEST_PASS && attempts == failed_attempts_.end()) {
+    writer->Append(" />\n");
+  } else {
+    writer->Append(">\n");
+    if (!run) {
+      writer->Append("      <skipped message=\"Not run because of the failure limit\" />\n");
+    } else if (test.result() != TEST_PASS) {
+      writer->Append("      <failure message=\"");
+      WriteXmlOutput(writer, test);
+      writer->Append("\" type=\"\">\n");
+      writer->Append("      </failure>\n");
+    }
+    if (attempts != failed_attempts_.end()) {
+      // The earlier runs of a test that was run again, in the format used
+      // by the maven surefire reports.
+      const char* tag = test.result() == TEST_PASS ? "flakyFailure" : "rerunFailure";
+      for (const auto& attempt : attempts->second) {
+        writer->Append(android::base::StringPrintf("      <%s message=\"", tag));
+        WriteXmlOutput(writer, *attempt);
+        writer->Append(android::base::StringPrintf("\" type=\"\" time=\"%.3lf\">\n",
+                                                   double(attempt->RunTimeNs()) / kNsPerMs));
+        writer->Append(android::base::StringPrintf("      </%s>\n", tag));
+      }
+    }
+    writer->Append("    </testcase>\n");
+  }
+  xml_ranges_[test.test_index()] = std::make_pair(begin, writer->offset());
+  writer->Append("  </testsuite>\n");
+  writer->EndRecord(NanoTime());
 }
 
 class TestResultPrinter : public ::testing::EmptyTestEventListener {
@@ -623,31 +2704,37 @@ void TestResultPrinter::OnTestPartResult(const ::testing::TestPartResult& result
   fflush(stdout);
 }
 
+void Isolate::UseTestResultPrinter() {
+  // Stop default result printer to avoid environment setup/teardown information for each test.
+  ::testing::UnitTest::GetInstance()->listeners().Release(
+      ::testing::UnitTest::GetInstance()->listeners().default_result_printer());
+  ::testing::UnitTest::GetInstance()->listeners().Append(new TestResultPrinter);
+}
+
 // Output xml file when --gtest_output is used, write this function as we can't reuse
 // gtest.cc:XmlUnitTestResultPrinter. The reason is XmlUnitTestResultPrinter is totally
 // defined in gtest.cc and not expose to outside. What's more, as we don't run gtest in
 // the parent process, we don't have gtest classes which are needed by XmlUnitTestResultPrinter.
-void Isolate::WriteXmlResults(uint64_t elapsed_time_ns, time_t start_time) {
-  FILE* fp = fopen(options_.xml_file().c_str(), "w");
-  if (fp == nullptr) {
-    printf("Cannot open xml file '%s': %s\n", options_.xml_file().c_str(), strerror(errno));
+void Isolate::WriteXmlResults(size_t binary_index, uint64_t elapsed_time_ns,
+                              time_t start_time) {
+  // The tests are already in the xml file, every one in a suite of its own.
+  // Write a new file grouped by suite next to it, and replace it with that.
+  std::unique_ptr<XmlWriter> results(std::move(xml_writers_[binary_index]));
+  results->Flush();
+  XmlWriter writer;
+  std::string xml_file(results->path() + ".tmp");
+  if (!writer.Open(xml_file, "")) {
+    printf("Cannot open xml file '%s': %s\n", xml_file.c_str(), strerror(errno));
     exit(1);
   }
 
-  const tm* time_struct = localtime(&start_time);
-  if (time_struct == nullptr) {
-    PLOG(FATAL) << "Unexpected failure from localtime";
-  }
-  char timestamp[40];
-  snprintf(timestamp, sizeof(timestamp), "%4d-%02d-%02dT%02d:%02d:%02d",
-           time_struct->tm_year + 1900, time_struct->tm_mon + 1, time_struct->tm_mday,
-           time_struct->tm_hour, time_struct->tm_min, time_struct->tm_sec);
-
-  fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n", fp);
-  fprintf(fp, "<testsuites tests=\"%zu\" failures=\"%zu\" disabled=\"0\" errors=\"0\"",
-          tests_.size(), total_fail_tests_ + total_timeout_tests_ + total_xpass_tests_);
-  fprintf(fp, " timestamp=\"%s\" time=\"%.3lf\" name=\"AllTests\">\n", timestamp,
-          double(elapsed_time_ns) / kNsPerMs);
+  writer.Append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  writer.Append(android::base::StringPrintf(
+      "<testsuites tests=\"%zu\" failures=\"%zu\" disabled=\"0\" errors=\"0\"", total_tests_,
+      total_fail_tests_ + total_timeout_tests_ + total_xpass_tests_));
+  writer.Append(android::base::StringPrintf(" timestamp=\"%s\" time=\"%.3lf\" name=\"AllTests\">\n",
+                                            XmlTimestamp(start_time).c_str(),
+                                            double(elapsed_time_ns) / kNsPerMs));
 
   // Construct the suite information.
   struct SuiteInfo {
@@ -674,40 +2761,36 @@ void Isolate::WriteXmlResults(uint64_t elapsed_time_ns, time_t start_time) {
     }
     info->tests.push_back(test);
     info->elapsed_ms += double(test->RunTimeNs()) / kNsPerMs;
-    if (test->result() != TEST_PASS) {
+    if (test->result() != TEST_PASS && test->result() != TEST_NOT_RUN) {
       info->fails++;
     }
   }
 
   for (auto& suite_entry : suites) {
-    fprintf(fp,
-            "  <testsuite name=\"%s\" tests=\"%zu\" failures=\"%zu\" disabled=\"0\" errors=\"0\"",
-            suite_entry.suite_name.c_str(), suite_entry.tests.size(), suite_entry.fails);
-    fprintf(fp, " time=\"%.3lf\">\n", suite_entry.elapsed_ms);
-
+    writer.Append(android::base::StringPrintf(
+        "  <testsuite name=\"%s\" tests=\"%zu\" failures=\"%zu\" disabled=\"0\" errors=\"0\"",
+        suite_entry.suite_name.c_str(), suite_entry.tests.size(), suite_entry.fails));
+    writer.Append(android::base::StringPrintf(" time=\"%.3lf\">\n", suite_entry.elapsed_ms));
     for (auto test : suite_entry.tests) {
-      fprintf(fp, "    <testcase name=\"%s\" status=\"run\" time=\"%.3lf\" classname=\"%s\"",
-              test->test_name().c_str(), double(test->RunTimeNs()) / kNsPerMs,
-              suite_entry.suite_name.c_str());
-      if (test->result() == TEST_PASS) {
-        fputs(" />\n", fp);
-      } else {
-        fputs(">\n", fp);
-        const std::string escaped_output = XmlEscape(test->output());
-        fprintf(fp, "      <failure message=\"%s\" type=\"\">\n", escaped_output.c_str());
-        fputs("      </failure>\n", fp);
-        fputs("    </testcase>\n", fp);
-      }
+      const auto& range = xml_ranges_.at(test->test_index());
+      writer.AppendRange(results->fd(), range.first, range.second);
     }
-    fputs("  </testsuite>\n", fp);
+    writer.Append("  </testsuite>\n");
+  }
+  writer.Append("</testsuites>\n");
+  writer.Close();
+  if (rename(xml_file.c_str(), results->path().c_str()) == -1) {
+    PLOG(FATAL) << "Unexpected failure renaming " << xml_file << " to " << results->path();
   }
-  fputs("</testsuites>\n", fp);
-  fclose(fp);
 }
 
 int Isolate::Run() {
+  run_start_ns_ = NanoTime();
   slow_threshold_ns_ = options_.slow_threshold_ms() * kNsPerMs;
   deadline_threshold_ns_ = options_.deadline_threshold_ms() * kNsPerMs;
+#if defined(__linux__)
+  output_in_file_ = options_.output_capture() == "memfd";
+#endif
 
   bool sharding_enabled = options_.total_shards() > 1;
   if (sharding_enabled &&
@@ -732,36 +2815,103 @@ int Isolate::Run() {
     printf("\n");
   }
 
-  EnumerateTests();
+  InitGtest();
 
-  // Stop default result printer to avoid environment setup/teardown information for each test.
-  ::testing::UnitTest::GetInstance()->listeners().Release(
-      ::testing::UnitTest::GetInstance()->listeners().default_result_printer());
-  ::testing::UnitTest::GetInstance()->listeners().Append(new TestResultPrinter);
-  RegisterSignalHandler();
+  // Tests listed by the binaries start running as soon as they are listed,
+  // unless all of them are needed to decide which ones run, or in what
+  // order.
+  bool stream = ::testing::UnitTest::GetInstance()->total_test_suite_count() == 0 &&
+                (!sharding_enabled || options_.sharding() == "round_robin") &&
+                options_.test_durations_file().empty() && options_.timing_db_file().empty();
+  if (stream) {
+    StartListings(true);
+  } else {
+    EnumerateTests();
+    if (sharding_enabled && options_.sharding() != "round_robin") {
+      ShardTests();
+    }
+  }
+
+  if (!options_.timing_db_file().empty()) {
+    LoadTimingDb();
+  }
+  if (!options_.test_durations_file().empty()) {
+    LoadTestDurations(options_.test_durations_file(), &test_durations_ms_);
+  }
+  ScheduleTests();
+
+  UseTestResultPrinter();
+  InitEvents();
+  runner_pid_ = getpid();
+#if defined(__linux__)
+  // The fork server and its children only know the tests listed when it
+  // starts, so while the tests are streamed they are forked from here.
+  if (options_.fork_server() && !enumerating_) {
+    StartForkServer();
+  }
+#endif
+  if (options_.memory_control()) {
+    oom_kill_file_ =
+        options_.oom_kill_file().empty() ? FindOomKillFile() : options_.oom_kill_file();
+  }
+  if (options_.spool_threshold_kb() != 0) {
+    CreateSpool();
+  }
 
-  std::string job_info("Running " + PluralizeString(total_tests_, " test") + " from " +
-                       PluralizeString(total_suites_, " test suite") + " (" +
-                       PluralizeString(options_.job_count(), " job") + ").");
+  if (binaries_.size() > 1) {
+    // Every binary gets its own xml file and log directory, named after the
+    // binary. The xml files go in the directory of the xml file.
+    const std::string& xml_file = options_.xml_file();
+    std::string xml_dir(xml_file.substr(0, xml_file.rfind('/') + 1));
+    std::unordered_map<std::string, size_t> names;
+    for (size_t i = 0; i < binaries_.size(); i++) {
+      std::string name(android::base::Basename(binaries_[i].args[0]));
+      if (names[name]++ != 0) {
+        name += '_' + std::to_string(i);
+      }
+      binaries_[i].name = name;
+      if (!xml_file.empty()) {
+        binaries_[i].xml_file = xml_dir + name + ".xml";
+      }
+    }
+  } else {
+    binaries_[0].xml_file = options_.xml_file();
+  }
 
   int exit_code = 0;
   for (int i = 0; options_.num_iterations() < 0 || i < options_.num_iterations(); i++) {
+    iteration_ = i + 1;
     if (i > 0) {
       printf("\nRepeating all tests (iteration %d) . . .\n\n", i + 1);
+      run_start_ns_ = NanoTime();
+    }
+    // The header is printed once all tests are listed.
+    if (!enumerating_) {
+      PrintHeader();
     }
-    ColoredPrintf(COLOR_GREEN, "[==========]");
-    printf(" %s\n", job_info.c_str());
-    fflush(stdout);
 
     time_t start_time = time(nullptr);
+    OpenXmlFiles(start_time);
     uint64_t time_ns = NanoTime();
     RunAllTests();
     time_ns = NanoTime() - time_ns;
 
+    if (binaries_.size() > 1) {
+      ReportBinaries(start_time);
+    }
+
     PrintFooter(time_ns);
 
-    if (!options_.xml_file().empty()) {
-      WriteXmlResults(time_ns, start_time);
+    if (binaries_.size() == 1 && !binaries_[0].xml_file.empty()) {
+      WriteXmlResults(0, time_ns, start_time);
+    }
+
+    if (!options_.test_durations_file().empty()) {
+      WriteTestDurations();
+    }
+
+    if (timing_db_) {
+      UpdateTimingDb();
     }
 
     if (total_pass_tests_ + total_skipped_tests_ + total_xfail_tests_ != tests_.size()) {
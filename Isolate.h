@@ -18,32 +18,59 @@
 
 #include <poll.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
+#include <deque>
 #include <map>
 #include <memory>
+#include <queue>
 #include <stack>
 #include <string>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
 #include "Color.h"
 #include "Options.h"
 #include "Test.h"
+#include "TimingDb.h"
+#include "XmlWriter.h"
 
 namespace android {
 namespace gtest_extras {
 
 class Isolate {
+  // Drives the timers with tests that are not running in real processes.
+  friend class IsolateTimersTest;
+
  public:
   Isolate(const Options& options, const std::vector<const char*>& child_args)
-      : options_(options), child_args_(child_args) {}
+      : options_(options), binaries_(1) {
+    binaries_[0].args = child_args;
+  }
+
+  // Runs the tests of several binaries with a single pool of jobs. The tests
+  // are listed by, and run from, each binary.
+  Isolate(const Options& options, const std::vector<std::vector<const char*>>& binaries_args)
+      : options_(options), binaries_(binaries_args.size()) {
+    for (size_t i = 0; i < binaries_args.size(); i++) {
+      binaries_[i].args = binaries_args[i];
+    }
+  }
 
   void EnumerateTests();
 
   int Run();
 
+  // Replaces the default gtest printer with the one used by the children
+  // running a single test, which only prints the failures.
+  static void UseTestResultPrinter();
+
  private:
   struct ResultsType {
     const char* color;
@@ -54,32 +81,234 @@ class Isolate {
     void (*print_func)(const Options&, const Test&);
   };
 
+  // The state of a child process that runs more than one test.
+  struct Batch {
+    pid_t pid = 0;
+    std::vector<size_t> test_indices;
+    // The position in test_indices of the test in running_.
+    size_t position = 0;
+    // The child reported that the test in running_ started.
+    bool started = false;
+    // The child reported that the last test of the batch ended.
+    bool ended = false;
+    int ended_status = 0;
+    // A test in this child failed, so it is expected to exit with 1.
+    bool failed = false;
+    // The test before the one in running_. It is only finished once the
+    // next test starts, since an exit in between cannot be attributed.
+    std::unique_ptr<Test> previous;
+    int previous_status = 0;
+    android::base::unique_fd control_fd;
+  };
+
+  // A test binary, and the tests_ that were enumerated from it.
+  struct Binary {
+    std::vector<const char*> args;
+    size_t tests_begin = 0;
+    size_t tests_end = 0;
+    size_t total_suites = 0;
+    size_t total_disable_tests = 0;
+    // Only set when there is more than one binary.
+    std::string name;
+    std::string xml_file;
+    // The key of the history of the tests of the binary in the timing db.
+    uint64_t timing_hash = 0;
+  };
+
+  // The output of a binary listing its tests, parsed as it arrives.
+  struct Listing {
+    std::string command;
+    // The pid is 0 once the listing process is reaped.
+    pid_t pid = 0;
+    android::base::unique_fd fd;
+    // Output that is not parsed yet.
+    std::string data;
+    bool done = false;
+    bool polled = false;
+    // The state of the parser.
+    std::string suite_name;
+    bool skip_until_next_suite = false;
+    bool new_suite = false;
+    bool sharded = false;
+    size_t test_count = 0;
+    // The totals before the tests of this listing.
+    size_t total_suites = 0;
+    size_t total_disable_tests = 0;
+  };
+
+  // The time at which a running test becomes slow or reaches its deadline.
+  struct TestTimer {
+    uint64_t time_ns;
+    bool deadline;
+    pid_t pid;
+    size_t test_index;
+    uint64_t start_ns;
+
+    // Orders the timers by time, a deadline goes before a slow timer at the
+    // same time.
+    bool operator>(const TestTimer& other) const {
+      if (time_ns != other.time_ns) {
+        return time_ns > other.time_ns;
+      }
+      return deadline < other.deadline;
+    }
+  };
+
+  // A child forked ahead of time, waiting for tests to be assigned to it.
+  struct Prefork {
+    pid_t pid = 0;
+    android::base::unique_fd output_fd;
+    android::base::unique_fd control_fd;
+  };
+
+  void AddTimers(pid_t pid, const Test* test);
+
+  size_t BinaryIndex(size_t test_index) const;
+
+  int BatchChildProcessFn(const std::vector<size_t>& test_indices, int control_fd);
+
+  size_t CheckBatchesProgress();
+
   size_t CheckTestsFinished();
 
   void CheckTestsTimeout();
 
-  int ChildProcessFn(const std::tuple<std::string, std::string>& test);
+  Test* TimerTest(const TestTimer& timer);
+
+  // When the first timer of a running test expires, UINT64_MAX if none is set.
+  uint64_t NextTimerNs();
+
+  int ChildProcessFn(size_t test_index);
+
+  void ParseListingLine(Listing* listing, const std::string& line);
+
+  bool ReadListings();
+
+  void StartListings(bool stream);
+
+  void StreamTests();
+
+  void EnumerateTestsFromRegistry();
+
+  pid_t ForkChild(const std::vector<size_t>& test_indices, int output_fd, int control_fd);
+
+#if defined(__linux__)
+  pid_t ForkFromServer(const std::vector<size_t>& test_indices, int output_fd, int control_fd);
+
+  int ForkServerFn(int server_fd);
+
+  void StartForkServer();
+#endif
+
+  bool ClaimOomKill(const Test& test);
+
+  uint64_t ReadOomKillCount() const;
+
+  size_t FinishBatch(std::unique_ptr<Test> test, int status);
+
+  size_t FinishTest(std::unique_ptr<Test> test, int status);
 
   void HandleSignals();
 
+  std::string HistoryName(size_t test_index) const;
+
+  void InitEvents();
+
+  void InitGtest();
+
   void LaunchTests();
 
+  std::vector<uint64_t> EstimateDurationsMs(
+      const std::map<std::string, uint64_t>& durations_ms) const;
+
+  void FilterTests(const std::vector<bool>& keep);
+
+  void LoadTestDurations(const std::string& file, std::map<std::string, uint64_t>* durations_ms);
+
+  void LoadTimingDb();
+
+  bool MemoryLow();
+
+  size_t ReadBatchMessages(size_t run_index);
+
+  void ReleasePreforked();
+
   void ReadTestsOutput();
 
+  void ThrottleOutput(size_t run_index, uint64_t now_ns);
+
   void RunAllTests();
 
-  void PrintFooter(uint64_t elapsed_time_ns);
+  void ScheduleTests();
+
+  void ShardTests();
+
+  std::vector<size_t> BalanceShards(const std::vector<uint64_t>& estimates_ms) const;
+
+  std::vector<size_t> HashShards(bool by_suite) const;
+
+  [[noreturn]] void RunChild(const std::vector<size_t>& test_indices, int output_fd,
+                             int control_fd);
+
+  pid_t SpawnChild(const std::vector<size_t>& test_indices, android::base::unique_fd* output_fd,
+                   android::base::unique_fd* control_fd);
+
+  std::vector<size_t> WaitForTests(int control_fd);
+
+  void WaitForEvents();
+
+  void PrintHeader();
+
+  void PrintFooter(uint64_t elapsed_time_ns, bool print_startup_time = true);
 
   void PrintResults(size_t total, const ResultsType& results, std::string* footer);
 
-  void WriteXmlResults(uint64_t elapsed_time_ns, time_t start_time);
+  void CountResult(const Test& test);
+
+  void AddResult(size_t test_index, std::unique_ptr<Test> test);
+
+  void CountResults();
+
+  bool FailureLimitReached() const;
+
+  void StopLaunchingTests();
+
+  void ReportBinaries(time_t start_time);
+
+  void CreateSpool();
+
+  bool KeepOutput(const Test& test) const;
+
+  void OpenLog(Test* test);
+
+  void SpoolOutput(Test* test);
+
+  void CompressOutput(Test* test);
+
+  void ShareOutput(Test* test);
+
+  void PrintFailureGroups();
+
+  void UpdateTimingDb();
+
+  void WriteTestDurations();
+
+  void OpenXmlFiles(time_t start_time);
+
+  void WriteXmlOutput(XmlWriter* writer, const Test& test);
+
+  void WriteXmlTest(const Test& test);
+
+  void FlushXmlFiles(uint64_t now_ns);
+
+  void WriteXmlResults(size_t binary_index, uint64_t elapsed_time_ns, time_t start_time);
 
   static std::string GetTestName(const std::tuple<std::string, std::string>& test) {
     return std::get<0>(test) + std::get<1>(test);
   }
 
   const Options& options_;
-  const std::vector<const char*>& child_args_;
+  std::vector<Binary> binaries_;
 
   size_t total_suites_ = 0;
   size_t total_tests_ = 0;
@@ -91,27 +320,130 @@ class Isolate {
   size_t total_timeout_tests_;
   size_t total_slow_tests_;
   size_t total_skipped_tests_;
+  size_t total_oom_tests_;
+  size_t total_not_run_tests_;
+  size_t total_flaky_tests_;
+  // The position in test_order_ of the next test to launch.
   size_t cur_test_index_ = 0;
 
   uint64_t slow_threshold_ns_;
+  // The children write their output to a memfd instead of a pipe.
+  bool output_in_file_ = false;
   uint64_t deadline_threshold_ns_;
   std::vector<std::tuple<std::string, std::string>> tests_;
+  // The registry entry for each test in tests_, or nullptr if the test is
+  // not registered in this process.
+  std::vector<const ::testing::TestInfo*> test_infos_;
+  // The indices of tests_ in the order they are launched.
+  std::vector<size_t> test_order_;
+  // Run times from previous runs, by test name.
+  std::map<std::string, uint64_t> test_durations_ms_;
+  std::unique_ptr<TimingDb> timing_db_;
 
   std::vector<Test*> running_;
   std::vector<pollfd> running_pollfds_;
+  // When to read the output of the test again, indexed by run index, 0 if
+  // the output is being read.
+  std::vector<uint64_t> output_resume_ns_;
   std::vector<size_t> running_indices_;
   std::unordered_map<pid_t, std::unique_ptr<Test>> running_by_pid_;
   std::map<size_t, Test*> running_by_test_index_;
+  // The slow and deadline timers of the running tests, earliest first. The
+  // timers of tests that finished are only removed once they expire.
+  std::priority_queue<TestTimer, std::vector<TestTimer>, std::greater<TestTimer>> timers_;
+  // Indexed by run index, the control_fd is -1 when running a single test.
+  std::vector<Batch> running_batches_;
+  // Tests from batches that did not finish, these run before any new tests.
+  std::deque<std::vector<size_t>> pending_batches_;
+  std::deque<Prefork> preforked_;
+  pid_t runner_pid_ = 0;
+
+  // The most tests that run at the same time, lowered every time the OOM
+  // killer kills a test that was not running alone.
+  size_t job_limit_ = 0;
+  // No tests are launched while memory is low, which is checked again at
+  // memory_check_ns_.
+  bool launch_held_ = false;
+  bool memory_low_ = false;
+  uint64_t memory_check_ns_ = 0;
+  // The file counting the OOM kills, and the count up to which every kill
+  // was attributed to a test.
+  std::string oom_kill_file_;
+  uint64_t oom_kills_claimed_ = 0;
+  // The tests killed by the OOM killer in this iteration.
+  std::unordered_set<size_t> oom_killed_;
+
+  // Once too many tests failed no more tests are launched, and the tests
+  // that were running are either left to finish or killed.
+  bool failure_limit_reached_ = false;
+  std::unordered_set<pid_t> killed_pids_;
 
   std::map<size_t, std::unique_ptr<Test>> finished_;
+  // The earlier runs of the tests that failed and were run again, by test
+  // index. The tests waiting to run again are launched after all the others.
+  std::map<size_t, std::vector<std::unique_ptr<Test>>> failed_attempts_;
+  std::deque<size_t> retry_tests_;
+  // Large outputs of finished tests are moved to this unlinked file, which
+  // is emptied at the start of every iteration.
+  android::base::unique_fd spool_fd_;
+  off_t spool_size_ = 0;
+  // The failed tests that other failed tests with the same output share
+  // their output with, by the hash of the output without the test name.
+  std::unordered_map<uint64_t, const Test*> shared_outputs_;
+  // The xml file of every binary, written as tests finish. Every test is in
+  // a suite of its own until the file is rewritten grouped by suite once
+  // all tests finished, copying the range of every test, by test index.
+  std::vector<std::unique_ptr<XmlWriter>> xml_writers_;
+  std::unordered_map<size_t, std::pair<off_t, off_t>> xml_ranges_;
+  // The escaped output of the tests whose output other tests share.
+  std::unordered_map<const Test*, std::string> xml_output_cache_;
+  // The output kept in memory is compressed, this is how much and how long
+  // it took in this iteration.
+  uint64_t compress_ns_ = 0;
+  uint64_t uncompressed_bytes_ = 0;
+  uint64_t compressed_bytes_ = 0;
+  // The directories of the log files that were created, and the iteration
+  // the log files are named after, starting at 1.
+  std::unordered_set<std::string> log_dirs_;
+  int iteration_ = 0;
+
+  // The test listings of the binaries, read one binary after the other so
+  // that the tests of a binary stay next to each other in tests_.
+  std::vector<Listing> listings_;
+  size_t cur_listing_ = 0;
+  // Tests are launched while the binaries are still listing them. Their
+  // results are held back until the header with the totals is printed.
+  bool enumerating_ = false;
+  std::vector<Test*> held_results_;
+  // When the iteration started, when the first test was launched, and when
+  // all tests were listed.
+  uint64_t run_start_ns_ = 0;
+  uint64_t first_launch_ns_ = 0;
+  uint64_t listed_ns_ = 0;
 
+#if defined(__linux__)
+  // The main loop blocks in epoll_wait until a child writes output, a child
+  // exits, the next slow/deadline threshold expires, or a signal arrives.
+  android::base::unique_fd epoll_fd_;
+  android::base::unique_fd signal_fd_;
+  android::base::unique_fd timer_fd_;
+  uint64_t timer_armed_ns_ = 0;
+  bool use_pidfd_ = false;
+  std::vector<android::base::unique_fd> running_pidfds_;
+  // Connection to the fork server, or -1 if children are forked directly.
+  android::base::unique_fd fork_server_fd_;
+#else
   static constexpr useconds_t MIN_USECONDS_WAIT = 1000;
+#endif
 
   static ResultsType SlowResults;
+  static ResultsType OomResults;
+  static ResultsType FlakyResults;
   static ResultsType XpassFailResults;
   static ResultsType FailResults;
   static ResultsType TimeoutResults;
   static ResultsType SkippedResults;
+  static ResultsType NotRunResults;
 };
 
 }  // namespace gtest_extras
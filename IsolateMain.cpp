@@ -20,6 +20,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <vector>
 
 #include <android-base/file.h>
@@ -59,6 +60,179 @@ static void PrintHelpInfo() {
   printf(
       " will be called slow.\n"
       "      Only valid in isolation mode. Default slow threshold is 2000 ms.\n");
+  ColoredPrintf(COLOR_GREEN, "  --batch_size=");
+  ColoredPrintf(COLOR_YELLOW, "[TEST_COUNT]\n");
+  printf("      Run up to ");
+  ColoredPrintf(COLOR_YELLOW, "[TEST_COUNT]");
+  printf(
+      " tests in each process instead of one.\n"
+      "      A test that crashes or times out only affects itself, the rest of\n"
+      "      its batch is run again in a new process.\n"
+      "      Only valid in isolation mode. Default batch size is 1.\n");
+  ColoredPrintf(COLOR_GREEN, "  --fork_server\n");
+  printf(
+      "      Fork tests from a small helper process started before any tests run,\n"
+      "      so the cost of fork does not grow with the results kept in memory.\n"
+      "      Only valid in isolation mode on Linux.\n");
+  ColoredPrintf(COLOR_GREEN, "  --prefork=");
+  ColoredPrintf(COLOR_YELLOW, "[CHILD_COUNT]\n");
+  printf("      Keep ");
+  ColoredPrintf(COLOR_YELLOW, "[CHILD_COUNT]");
+  printf(
+      " children forked ahead of time, waiting for the next tests.\n"
+      "      A free job slot starts running tests without waiting for a fork.\n"
+      "      Only valid in isolation mode. By default no children are preforked.\n");
+  ColoredPrintf(COLOR_GREEN, "  --max_memory_pressure=");
+  ColoredPrintf(COLOR_YELLOW, "[PERCENT]\n");
+  printf("      Do not start new tests while tasks stall on memory more than ");
+  ColoredPrintf(COLOR_YELLOW, "[PERCENT]");
+  printf(
+      "\n"
+      "      of the time, as reported by /proc/pressure/memory.\n"
+      "      Only valid in isolation mode on Linux. By default, or when set to 0,\n"
+      "      the memory pressure is not checked.\n");
+  ColoredPrintf(COLOR_GREEN, "  --min_available_memory_mb=");
+  ColoredPrintf(COLOR_YELLOW, "[MEGABYTES]\n");
+  printf("      Do not start new tests while less than ");
+  ColoredPrintf(COLOR_YELLOW, "[MEGABYTES]");
+  printf(
+      " of memory is available.\n"
+      "      While either this or --max_memory_pressure is set, a test killed by\n"
+      "      the OOM killer is run again with fewer jobs.\n"
+      "      Only valid in isolation mode on Linux. By default, or when set to 0,\n"
+      "      the available memory is not checked.\n");
+  ColoredPrintf(COLOR_GREEN, "  --oom_kill_file=");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]\n");
+  printf("      Count the OOM kills with the oom_kill line of ");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]");
+  printf(
+      ", such as the\n"
+      "      memory.events file of a cgroup. A killed test is only run again if\n"
+      "      the count went up while it ran. Default is the file of the memory\n"
+      "      cgroup of this process, or /proc/vmstat without one.\n");
+  ColoredPrintf(COLOR_GREEN, "  --test_durations=");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]\n");
+  printf(
+      "      Start the tests that took the longest in previous runs first, using\n"
+      "      the run times in ");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]");
+  printf(
+      ". The file is updated after every run.\n"
+      "      Only valid in isolation mode.\n");
+  ColoredPrintf(COLOR_GREEN, "  --sharding=");
+  ColoredPrintf(COLOR_YELLOW, "[round_robin|balanced|hash|hash_suite]\n");
+  printf(
+      "      How GTEST_TOTAL_SHARDS splits the tests. round_robin gives every shard\n"
+      "      every n-th test. balanced gives every shard about the same total run\n"
+      "      time, using the run times from --shard_durations. Every shard must use\n"
+      "      the same file, which is not updated by the run. hash places every test\n"
+      "      by a hash of its name, so adding or removing tests does not move the\n"
+      "      other tests to a different shard. hash_suite does the same with whole\n"
+      "      test suites. Except for round_robin, the number of tests and the\n"
+      "      estimated run time of every shard are printed.\n"
+      "      Only valid in isolation mode. Default is round_robin.\n");
+  ColoredPrintf(COLOR_GREEN, "  --shard_durations=");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]\n");
+  printf("      The run times used to shard the tests, in the format of --test_durations.\n");
+  ColoredPrintf(COLOR_GREEN, "  --timing_db=");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]\n");
+  printf(
+      "      Keep the run time, peak memory and result of the last runs of every\n"
+      "      test in ");
+  ColoredPrintf(COLOR_YELLOW, "[FILE]");
+  printf(
+      ", and start the longest tests first. The file can be shared\n"
+      "      by several test binaries and runners. Only valid in isolation mode.\n");
+  ColoredPrintf(COLOR_GREEN, "  --fail_fast\n");
+  printf(
+      "      Stop launching tests after the first test fails.\n"
+      "      Only valid in isolation mode.\n");
+  ColoredPrintf(COLOR_GREEN, "  --max_failures=");
+  ColoredPrintf(COLOR_YELLOW, "[TEST_COUNT]\n");
+  printf("      Stop launching tests once more than ");
+  ColoredPrintf(COLOR_YELLOW, "[TEST_COUNT]");
+  printf(
+      " tests failed.\n"
+      "      Only valid in isolation mode. By default there is no limit.\n");
+  ColoredPrintf(COLOR_GREEN, "  --max_failure_ratio=");
+  ColoredPrintf(COLOR_YELLOW, "[RATIO]\n");
+  printf("      Stop launching tests once more than ");
+  ColoredPrintf(COLOR_YELLOW, "[RATIO]");
+  printf(
+      " of all the tests failed, for example 0.1.\n"
+      "      Only valid in isolation mode. By default there is no limit.\n");
+  ColoredPrintf(COLOR_GREEN, "  --kill_on_failure_limit\n");
+  printf(
+      "      Kill the running tests when a failure limit is reached, instead of\n"
+      "      letting them finish. The tests that never finished are listed as\n"
+      "      not run. Only valid in isolation mode.\n");
+  ColoredPrintf(COLOR_GREEN, "  --retry_failed=");
+  ColoredPrintf(COLOR_YELLOW, "[COUNT]\n");
+  printf("      Run a test that failed or timed out again, up to ");
+  ColoredPrintf(COLOR_YELLOW, "[COUNT]");
+  printf(
+      " times,\n"
+      "      once all the other tests were launched. Tests that pass on a retry are\n"
+      "      listed as flaky. Only valid in isolation mode. By default no test is retried.\n");
+  ColoredPrintf(COLOR_GREEN, "  --output_capture=");
+  ColoredPrintf(COLOR_YELLOW, "[pipe|memfd]\n");
+  printf(
+      "      How the output of the tests is captured. memfd makes every child write\n"
+      "      to an in-memory file that is only read once the test finished, and\n"
+      "      only if the output is needed after it is printed. memfd is only\n"
+      "      supported on Linux. Only valid in isolation mode. Default is pipe.\n");
+  ColoredPrintf(COLOR_GREEN, "  --spool_threshold_kb=");
+  ColoredPrintf(COLOR_YELLOW, "[SIZE_KB]\n");
+  printf("      Move the output of finished tests that is larger than ");
+  ColoredPrintf(COLOR_YELLOW, "[SIZE_KB]");
+  printf(
+      "\n"
+      "      to a temporary file, which the xml file is written from. This keeps the\n"
+      "      memory of the runner down when tests write a lot of output.\n"
+      "      Only valid in isolation mode. By default all output is kept in memory.\n");
+  ColoredPrintf(COLOR_GREEN, "  --keep_output=");
+  ColoredPrintf(COLOR_YELLOW, "[all|failures|none]\n");
+  printf(
+      "      Which output is kept for the xml file once it is printed. failures\n"
+      "      drops the output of tests that passed or were skipped, none drops\n"
+      "      all output. Only valid in isolation mode. Default is all.\n");
+  ColoredPrintf(COLOR_GREEN, "  --output_limit_kb=");
+  ColoredPrintf(COLOR_YELLOW, "[SIZE_KB]\n");
+  printf("      Only keep the first and the last ");
+  ColoredPrintf(COLOR_YELLOW, "[SIZE_KB]");
+  printf(
+      " of the output of every test. The\n"
+      "      output in between is replaced by a line with the number of bytes that\n"
+      "      were dropped. Only valid in isolation mode. By default there is no limit.\n");
+  ColoredPrintf(COLOR_GREEN, "  --output_dir=");
+  ColoredPrintf(COLOR_YELLOW, "[DIR]\n");
+  printf("      Write all of the output of every test to ");
+  ColoredPrintf(COLOR_YELLOW, "[DIR]");
+  printf(
+      "/SUITE/TEST.ITERATION.log,\n"
+      "      whether it passed or not. Runs of failed tests that are run again go to\n"
+      "      TEST.ITERATION.retryN.log. The output is moved to the file without\n"
+      "      being kept in memory. Only valid in isolation mode.\n");
+  ColoredPrintf(COLOR_GREEN, "  --max_output_rate_kb=");
+  ColoredPrintf(COLOR_YELLOW, "[SIZE_KB]\n");
+  printf("      Stop reading the output of a test that writes more than ");
+  ColoredPrintf(COLOR_YELLOW, "[SIZE_KB]");
+  printf(
+      "\n"
+      "      per second on average until it is back under that rate, which blocks the\n"
+      "      test once its pipe is full. Not used with --output_capture=memfd.\n"
+      "      Only valid in isolation mode. By default the output is always read.\n");
+  ColoredPrintf(COLOR_GREEN, "  --compress_output\n");
+  printf(
+      "      Compress the output that is kept for the xml file once it is printed.\n"
+      "      The footer reports how much smaller the output got and how long it\n"
+      "      took. Only valid in isolation mode.\n");
+  ColoredPrintf(COLOR_GREEN, "  --dedupe_failures\n");
+  printf(
+      "      Group the tests that failed the same way, ignoring line numbers and\n"
+      "      addresses, and print the output of each group once in the footer. Tests\n"
+      "      whose output only differs by the name of the test keep one copy of it\n"
+      "      for the xml file. Only valid in isolation mode.\n");
   ColoredPrintf(COLOR_GREEN, "  --gtest_format\n");
   printf(
       "      Use the default gtest format, not the enhanced format.\n"
@@ -126,6 +300,15 @@ int IsolateMain(int argc, char** argv, char**) {
   }
 
   if (!android::gtest_extras::RunInIsolationMode(args)) {
+    // A test run by gtest_isolated_runner from this binary, it prints its
+    // output the way a child forked in isolation mode does.
+    auto child = std::find_if(args.begin(), args.end(), [](const char* arg) {
+      return strcmp(arg, "--isolated_child") == 0;
+    });
+    if (child != args.end()) {
+      args.erase(child);
+      android::gtest_extras::Isolate::UseTestResultPrinter();
+    }
     return android::gtest_extras::GtestRun(&args);
   }
 
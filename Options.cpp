@@ -43,6 +43,29 @@ constexpr uint64_t kDefaultSlowThresholdMs = 2000;
 const std::unordered_map<std::string, Options::ArgInfo> Options::kArgs = {
     {"deadline_threshold_ms", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
     {"slow_threshold_ms", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"batch_size", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"fork_server", {FLAG_NONE, &Options::SetBool}},
+    {"prefork", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"max_memory_pressure", {FLAG_REQUIRES_VALUE, &Options::SetNumericOrOff}},
+    {"min_available_memory_mb", {FLAG_REQUIRES_VALUE, &Options::SetNumericOrOff}},
+    {"oom_kill_file", {FLAG_REQUIRES_VALUE, &Options::SetString}},
+    {"test_durations", {FLAG_REQUIRES_VALUE, &Options::SetString}},
+    {"timing_db", {FLAG_REQUIRES_VALUE, &Options::SetString}},
+    {"sharding", {FLAG_REQUIRES_VALUE, &Options::SetSharding}},
+    {"shard_durations", {FLAG_REQUIRES_VALUE, &Options::SetString}},
+    {"fail_fast", {FLAG_NONE, &Options::SetBool}},
+    {"max_failures", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"max_failure_ratio", {FLAG_REQUIRES_VALUE, &Options::SetFailureRatio}},
+    {"kill_on_failure_limit", {FLAG_NONE, &Options::SetBool}},
+    {"retry_failed", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"output_capture", {FLAG_REQUIRES_VALUE, &Options::SetOutputCapture}},
+    {"spool_threshold_kb", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"keep_output", {FLAG_REQUIRES_VALUE, &Options::SetKeepOutput}},
+    {"output_limit_kb", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"output_dir", {FLAG_REQUIRES_VALUE, &Options::SetString}},
+    {"max_output_rate_kb", {FLAG_REQUIRES_VALUE, &Options::SetNumeric}},
+    {"compress_output", {FLAG_NONE, &Options::SetBool}},
+    {"dedupe_failures", {FLAG_NONE, &Options::SetBool}},
     {"gtest_format", {FLAG_NONE, &Options::SetBool}},
     {"no_gtest_format", {FLAG_NONE, &Options::SetBool}},
     {"gtest_list_tests", {FLAG_NONE, &Options::SetBool}},
@@ -125,6 +148,11 @@ bool Options::SetNumeric(const std::string& arg, const std::string& value, bool
   return true;
 }
 
+bool Options::SetNumericOrOff(const std::string& arg, const std::string& value, bool from_env) {
+  // Zero turns the option off.
+  return GetNumeric<uint64_t>(arg.c_str(), value.c_str(), &numerics_.find(arg)->second, from_env);
+}
+
 bool Options::SetNumericEnvOnly(const std::string& arg, const std::string& value, bool from_env) {
   if (!from_env) {
     PrintError(arg, "is only supported as an environment variable.", false);
@@ -154,6 +182,46 @@ bool Options::SetString(const std::string& arg, const std::string& value, bool)
   return true;
 }
 
+bool Options::SetSharding(const std::string& arg, const std::string& value, bool from_env) {
+  if (value != "round_robin" && value != "balanced" && value != "hash" && value != "hash_suite") {
+    PrintError(arg, "must be one of round_robin, balanced, hash or hash_suite (" + value + ")",
+               from_env);
+    return false;
+  }
+  strings_.find(arg)->second = value;
+  return true;
+}
+
+bool Options::SetOutputCapture(const std::string& arg, const std::string& value, bool from_env) {
+  if (value != "pipe" && value != "memfd") {
+    PrintError(arg, "must be one of pipe or memfd (" + value + ")", from_env);
+    return false;
+  }
+  strings_.find(arg)->second = value;
+  return true;
+}
+
+bool Options::SetKeepOutput(const std::string& arg, const std::string& value, bool from_env) {
+  if (value != "all" && value != "failures" && value != "none") {
+    PrintError(arg, "must be one of all, failures or none (" + value + ")", from_env);
+    return false;
+  }
+  strings_.find(arg)->second = value;
+  return true;
+}
+
+bool Options::SetFailureRatio(const std::string& arg, const std::string& value, bool from_env) {
+  char* end;
+  errno = 0;
+  double ratio = strtod(value.c_str(), &end);
+  if (errno != 0 || *end != '\0' || !(ratio > 0 && ratio <= 1)) {
+    PrintError(arg, "requires a number greater than 0 and at most 1 (" + value + ")", from_env);
+    return false;
+  }
+  max_failure_ratio_ = ratio;
+  return true;
+}
+
 bool Options::SetXmlFile(const std::string& arg, const std::string& value, bool from_env) {
   if (value.substr(0, 4) != "xml:") {
     PrintError(arg, "only supports an xml output file.", from_env);
@@ -215,21 +283,44 @@ bool Options::Process(const std::vector<const char*>& args, std::vector<const ch
   // Initialize the variables.
   job_count_ = static_cast<size_t>(sysconf(_SC_NPROCESSORS_ONLN));
   num_iterations_ = ::testing::GTEST_FLAG(repeat);
+  max_failure_ratio_ = 0;
   numerics_.clear();
   numerics_["deadline_threshold_ms"] = kDefaultDeadlineThresholdMs;
   numerics_["slow_threshold_ms"] = kDefaultSlowThresholdMs;
+  numerics_["batch_size"] = 1;
+  numerics_["prefork"] = 0;
+  numerics_["max_memory_pressure"] = 0;
+  numerics_["min_available_memory_mb"] = 0;
+  numerics_["max_failures"] = 0;
+  numerics_["retry_failed"] = 0;
+  numerics_["spool_threshold_kb"] = 0;
+  numerics_["output_limit_kb"] = 0;
+  numerics_["max_output_rate_kb"] = 0;
   numerics_["gtest_shard_index"] = 0;
   numerics_["gtest_total_shards"] = 0;
   strings_.clear();
   strings_["gtest_color"] = ::testing::GTEST_FLAG(color);
   strings_["xml_file"] = ::testing::GTEST_FLAG(output);
   strings_["gtest_filter"] = "";
+  strings_["test_durations"] = "";
+  strings_["timing_db"] = "";
+  strings_["oom_kill_file"] = "";
+  strings_["sharding"] = "round_robin";
+  strings_["shard_durations"] = "";
+  strings_["output_capture"] = "pipe";
+  strings_["keep_output"] = "all";
+  strings_["output_dir"] = "";
   bools_.clear();
   bools_["gtest_print_time"] = ::testing::GTEST_FLAG(print_time);
   bools_["gtest_format"] = true;
   bools_["no_gtest_format"] = false;
   bools_["gtest_also_run_disabled_tests"] = ::testing::GTEST_FLAG(also_run_disabled_tests);
   bools_["gtest_list_tests"] = false;
+  bools_["fork_server"] = false;
+  bools_["fail_fast"] = false;
+  bools_["kill_on_failure_limit"] = false;
+  bools_["compress_output"] = false;
+  bools_["dedupe_failures"] = false;
 
   child_args->clear();
 
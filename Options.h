@@ -36,9 +36,24 @@ class Options {
 
   size_t job_count() const { return job_count_; }
   int num_iterations() const { return num_iterations_; }
+  double max_failure_ratio() const { return max_failure_ratio_; }
 
   uint64_t deadline_threshold_ms() const { return numerics_.at("deadline_threshold_ms"); }
   uint64_t slow_threshold_ms() const { return numerics_.at("slow_threshold_ms"); }
+  uint64_t batch_size() const { return numerics_.at("batch_size"); }
+  uint64_t prefork() const { return numerics_.at("prefork"); }
+  uint64_t max_memory_pressure() const { return numerics_.at("max_memory_pressure"); }
+  uint64_t min_available_memory_mb() const { return numerics_.at("min_available_memory_mb"); }
+  // Whether new tests are held back while memory is low.
+  bool memory_control() const {
+    return max_memory_pressure() != 0 || min_available_memory_mb() != 0;
+  }
+  const std::string& oom_kill_file() const { return strings_.at("oom_kill_file"); }
+  uint64_t max_failures() const { return numerics_.at("max_failures"); }
+  uint64_t retry_failed() const { return numerics_.at("retry_failed"); }
+  uint64_t spool_threshold_kb() const { return numerics_.at("spool_threshold_kb"); }
+  uint64_t output_limit_kb() const { return numerics_.at("output_limit_kb"); }
+  uint64_t max_output_rate_kb() const { return numerics_.at("max_output_rate_kb"); }
 
   uint64_t shard_index() const { return numerics_.at("gtest_shard_index"); }
   uint64_t total_shards() const { return numerics_.at("gtest_total_shards"); }
@@ -47,14 +62,27 @@ class Options {
   bool gtest_format() const { return bools_.at("gtest_format"); }
   bool allow_disabled_tests() const { return bools_.at("gtest_also_run_disabled_tests"); }
   bool list_tests() const { return bools_.at("gtest_list_tests"); }
+  bool fork_server() const { return bools_.at("fork_server"); }
+  bool fail_fast() const { return bools_.at("fail_fast"); }
+  bool kill_on_failure_limit() const { return bools_.at("kill_on_failure_limit"); }
+  bool compress_output() const { return bools_.at("compress_output"); }
+  bool dedupe_failures() const { return bools_.at("dedupe_failures"); }
 
   const std::string& color() const { return strings_.at("gtest_color"); }
   const std::string& xml_file() const { return strings_.at("xml_file"); }
   const std::string& filter() const { return strings_.at("gtest_filter"); }
+  const std::string& test_durations_file() const { return strings_.at("test_durations"); }
+  const std::string& timing_db_file() const { return strings_.at("timing_db"); }
+  const std::string& sharding() const { return strings_.at("sharding"); }
+  const std::string& shard_durations_file() const { return strings_.at("shard_durations"); }
+  const std::string& output_capture() const { return strings_.at("output_capture"); }
+  const std::string& keep_output() const { return strings_.at("keep_output"); }
+  const std::string& output_dir() const { return strings_.at("output_dir"); }
 
  private:
   size_t job_count_;
   int num_iterations_;
+  double max_failure_ratio_;
 
   std::unordered_map<std::string, bool> bools_;
   std::unordered_map<std::string, std::string> strings_;
@@ -79,12 +107,17 @@ class Options {
                  bool from_env = false);
 
   bool SetNumeric(const std::string&, const std::string&, bool);
+  bool SetNumericOrOff(const std::string&, const std::string&, bool);
   bool SetNumericEnvOnly(const std::string&, const std::string&, bool);
   bool SetBool(const std::string&, const std::string&, bool);
   bool SetString(const std::string&, const std::string&, bool);
   bool SetIterations(const std::string&, const std::string&, bool);
   bool SetXmlFile(const std::string&, const std::string&, bool);
   bool SetPrintTime(const std::string&, const std::string&, bool);
+  bool SetSharding(const std::string&, const std::string&, bool);
+  bool SetFailureRatio(const std::string&, const std::string&, bool);
+  bool SetOutputCapture(const std::string&, const std::string&, bool);
+  bool SetKeepOutput(const std::string&, const std::string&, bool);
 
   const static std::unordered_map<std::string, ArgInfo> kArgs;
 };
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Isolate.h"
+#include "Options.h"
+
+// Runs the tests of several gtest_isolated binaries with one pool of jobs,
+// so that no job is idle while the last tests of a binary finish.
+int main(int argc, char** argv) {
+  std::vector<const char*> args{argv[0]};
+  std::vector<const char*> binaries;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+      binaries.clear();
+      break;
+    }
+    if (argv[i][0] != '-') {
+      binaries.push_back(argv[i]);
+      continue;
+    }
+    args.push_back(argv[i]);
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      args.push_back(argv[++i]);
+    }
+  }
+  if (binaries.empty()) {
+    printf(
+        "Usage: %s [OPTIONS] BINARY...\n"
+        "  Run the tests of every BINARY in isolation, sharing the jobs between all\n"
+        "  of them. The options are the same as the isolation options of the\n"
+        "  binaries. The results are reported for every binary, and --gtest_output\n"
+        "  writes one xml file for each binary, named after the binary.\n",
+        argv[0]);
+    return 1;
+  }
+
+  android::gtest_extras::Options options;
+  std::vector<const char*> child_args;
+  if (!options.Process(args, &child_args)) {
+    return 1;
+  }
+  // Force the binaries not to rerun in isolation mode.
+  child_args.push_back("--no_isolate");
+
+  std::vector<std::vector<const char*>> binaries_args;
+  for (const char* binary : binaries) {
+    binaries_args.push_back(child_args);
+    binaries_args.back()[0] = binary;
+  }
+
+  ::testing::GTEST_FLAG(color) = options.color();
+  ::testing::GTEST_FLAG(print_time) = options.print_time();
+
+  android::gtest_extras::Isolate isolate(options, binaries_args);
+  return isolate.Run();
+}
@@ -14,14 +14,24 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
 #include <string>
 #include <tuple>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <gtest/gtest.h>
 
@@ -32,6 +42,53 @@
 namespace android {
 namespace gtest_extras {
 
+// A skipped test starts its output with the skip message, so only this
+// much of a file is read to find out if a test was skipped.
+constexpr size_t kSkipCheckSize = 4096;
+
+// The most output moved from a pipe to a log file at once.
+constexpr size_t kLogChunkSize = 1024 * 1024;
+
+// The most output read from a pipe each time it is ready, so that a chatty
+// test does not hold up reading the output of the other tests.
+constexpr size_t kMaxReadSize = 1024 * 1024;
+
+// Shown in place of the output between the start and the end of the output
+// that is kept.
+static std::string DroppedMarker(uint64_t bytes, bool at_line_start) {
+  return std::string(at_line_start ? "" : "\n") + "... " + std::to_string(bytes) +
+         " bytes of output dropped ...\n";
+}
+
+// Copies the range of from_fd to the current offset of to_fd, without
+// going through user space where the kernel supports it. Returns the number
+// of bytes copied.
+static off_t CopyRange(int from_fd, int to_fd, off_t offset, off_t end) {
+  off_t begin = offset;
+  while (offset < end) {
+    ssize_t bytes = -1;
+#if defined(__linux__)
+    bytes = TEMP_FAILURE_RETRY(sendfile(to_fd, from_fd, &offset, end - offset));
+#endif
+    if (bytes == -1) {
+      // Copy through a buffer if the destination does not support sendfile.
+      char buffer[65536];
+      size_t size = std::min<off_t>(sizeof(buffer), end - offset);
+      bytes = TEMP_FAILURE_RETRY(pread(from_fd, buffer, size, offset));
+      if (bytes > 0) {
+        if (!android::base::WriteFully(to_fd, buffer, bytes)) {
+          break;
+        }
+        offset += bytes;
+      }
+    }
+    if (bytes <= 0) {
+      break;
+    }
+  }
+  return offset - begin;
+}
+
 Test::Test(std::tuple<std::string, std::string>& test, size_t index, size_t run_index, int fd)
     : suite_name_(std::get<0>(test)),
       test_name_(std::get<1>(test)),
@@ -49,10 +106,252 @@ void Test::CloseFd() {
   fd_.reset();
 }
 
+void Test::SetOutputFile(off_t offset) {
+  output_in_file_ = true;
+  output_begin_ = offset;
+  output_end_ = offset;
+}
+
+void Test::SetLogFile(int fd, const std::string& path) {
+  log_fd_.reset(fd);
+  log_path_ = path;
+}
+
+void Test::LoadOutput() {
+  if (!output_in_file_) {
+    return;
+  }
+  std::string output;
+  output.reserve(output_end_ - output_begin_ + output_.size());
+  ReadOutput([&output](const char* data, size_t size) { output.append(data, size); });
+  output_.swap(output);
+  output_in_file_ = false;
+  fd_.reset();
+}
+
+void Test::SpoolOutput(int spool_fd, off_t offset) {
+  spool_fd_ = spool_fd;
+  output_begin_ = offset;
+  output_end_ = offset + output_.size();
+  // Release the memory, clear would keep it.
+  std::string().swap(output_);
+}
+
+void Test::CompressOutput() {
+  if (output_in_file_ || spool_fd_ != -1 || compressed_ || shared_output_ != nullptr ||
+      output_.empty()) {
+    return;
+  }
+  compressed_.reset(new CompressedOutput(output_.data(), output_.size()));
+  std::string().swap(output_);
+}
+
+void Test::ShareOutput(const Test* original) {
+  shared_output_ = original;
+  std::string().swap(output_);
+}
+
+void Test::ReadOutputAs(const std::string& name,
+                        const std::function<void(const char*, size_t)>& fn) const {
+  // The end of each piece is held back in case the name continues in the
+  // next piece.
+  std::string pending;
+  std::string replaced;
+  ReadOutput([&](const char* data, size_t size) {
+    pending.append(data, size);
+    replaced.clear();
+    size_t pos = 0;
+    size_t found;
+    while ((found = pending.find(name_, pos)) != std::string::npos) {
+      replaced.append(pending, pos, found - pos);
+      replaced += name;
+      pos = found + name_.size();
+    }
+    size_t keep = std::min(pending.size() - pos, name_.size() - 1);
+    replaced.append(pending, pos, pending.size() - pos - keep);
+    pending.erase(0, pending.size() - keep);
+    fn(replaced.data(), replaced.size());
+  });
+  if (!pending.empty()) {
+    fn(pending.data(), pending.size());
+  }
+}
+
+void Test::DropOutput() {
+  shared_output_ = nullptr;
+  compressed_.reset();
+  std::string().swap(output_);
+  if (output_in_file_) {
+    output_in_file_ = false;
+    fd_.reset();
+  }
+  spool_fd_ = -1;
+}
+
+void Test::KeptFileRange(off_t* head_end, off_t* tail_begin) const {
+  *head_end = output_end_;
+  *tail_begin = output_end_;
+  // The spool file only has output that was already cut down.
+  if (output_in_file_ && output_limit_ != 0 &&
+      static_cast<size_t>(output_end_ - output_begin_) > 2 * output_limit_) {
+    *head_end = output_begin_ + output_limit_;
+    *tail_begin = output_end_ - output_limit_;
+  }
+}
+
+void Test::ReadOutput(const std::function<void(const char*, size_t)>& fn) const {
+  if (shared_output_ != nullptr) {
+    shared_output_->ReadOutputAs(name_, fn);
+    return;
+  }
+  if (compressed_) {
+    compressed_->Read(fn);
+    return;
+  }
+  int fd = output_in_file_ ? fd_.get() : spool_fd_;
+  android::base::unique_fd log_fd;
+  if (output_in_file_ && fd == -1) {
+    // The log file was closed once the output was printed.
+    log_fd.reset(open(log_path_.c_str(), O_RDONLY | O_CLOEXEC));
+    if (log_fd == -1) {
+      PLOG(FATAL) << "Unable to open the log file " << log_path_;
+    }
+    fd = log_fd.get();
+  }
+  if (fd == -1) {
+    fn(output_.data(), output_.size());
+    return;
+  }
+  char buffer[65536];
+  char last = '\n';
+  auto read_range = [&](off_t offset, off_t end) {
+    while (offset < end) {
+      size_t size = std::min<off_t>(sizeof(buffer), end - offset);
+      ssize_t bytes = TEMP_FAILURE_RETRY(pread(fd, buffer, size, offset));
+      if (bytes == -1) {
+        PLOG(FATAL) << "Unexpected failure from pread";
+      }
+      if (bytes == 0) {
+        break;
+      }
+      last = buffer[bytes - 1];
+      fn(buffer, bytes);
+      offset += bytes;
+    }
+  };
+  off_t head_end, tail_begin;
+  KeptFileRange(&head_end, &tail_begin);
+  read_range(output_begin_, head_end);
+  if (tail_begin > head_end) {
+    std::string marker(DroppedMarker(tail_begin - head_end, last == '\n'));
+    fn(marker.data(), marker.size());
+    read_range(tail_begin, output_end_);
+  }
+  if (output_in_file_ && !output_.empty()) {
+    fn(output_.data(), output_.size());
+  }
+}
+
+void Test::PrintOutput() {
+  if (spool_fd_ != -1 || compressed_ || shared_output_ != nullptr) {
+    ReadOutput([](const char* data, size_t size) { fwrite(data, 1, size, stdout); });
+    return;
+  }
+  if (!output_in_file_) {
+    printf("%s", output_.c_str());
+    return;
+  }
+
+  // Copy the output straight from the file. It is only printed once, so
+  // the file is not needed anymore after this, unless it is a log file.
+  fflush(stdout);
+  off_t head_end, tail_begin;
+  KeptFileRange(&head_end, &tail_begin);
+  CopyRange(fd_, STDOUT_FILENO, output_begin_, head_end);
+  if (tail_begin > head_end) {
+    char last = '\n';
+    if (TEMP_FAILURE_RETRY(pread(fd_, &last, 1, head_end - 1)) == -1) {
+      PLOG(FATAL) << "Unexpected failure from pread";
+    }
+    printf("%s", DroppedMarker(tail_begin - head_end, last == '\n').c_str());
+    fflush(stdout);
+    CopyRange(fd_, STDOUT_FILENO, tail_begin, output_end_);
+  }
+  printf("%s", output_.c_str());
+  if (log_path_.empty()) {
+    output_in_file_ = false;
+  }
+  fd_.reset();
+}
+
+void Test::AddOutput(const char* data, size_t size) {
+  if (output_limit_ == 0) {
+    output_.append(data, size);
+    return;
+  }
+  if (output_.size() < output_limit_) {
+    size_t head_size = std::min(size, output_limit_ - output_.size());
+    output_.append(data, head_size);
+    data += head_size;
+    size -= head_size;
+  }
+  if (size == 0) {
+    return;
+  }
+
+  // Only the last output_limit_ bytes are kept in the tail, which is
+  // a ring buffer once it is full.
+  if (size >= output_limit_) {
+    dropped_bytes_ += tail_.size() + size - output_limit_;
+    tail_.assign(data + size - output_limit_, output_limit_);
+    tail_pos_ = 0;
+    return;
+  }
+  if (tail_.size() < output_limit_) {
+    size_t append_size = std::min(size, output_limit_ - tail_.size());
+    tail_.append(data, append_size);
+    data += append_size;
+    size -= append_size;
+  }
+  dropped_bytes_ += size;
+  while (size > 0) {
+    size_t copy_size = std::min(size, output_limit_ - tail_pos_);
+    memcpy(&tail_[tail_pos_], data, copy_size);
+    tail_pos_ = (tail_pos_ + copy_size) % output_limit_;
+    data += copy_size;
+    size -= copy_size;
+  }
+}
+
+void Test::FinishOutput() {
+  if (log_fd_ != -1) {
+    if (output_in_file_) {
+      // The output is in a file shared by all tests of the child.
+      log_size_ = CopyRange(fd_, log_fd_, output_begin_, output_end_);
+    }
+    // From now on the output is read from the log file.
+    fd_ = std::move(log_fd_);
+    output_in_file_ = true;
+    output_begin_ = 0;
+    output_end_ = log_size_;
+    return;
+  }
+  if (tail_.empty()) {
+    return;
+  }
+  if (dropped_bytes_ != 0) {
+    output_ += DroppedMarker(dropped_bytes_, output_.empty() || output_.back() == '\n');
+  }
+  output_.append(tail_, tail_pos_, std::string::npos);
+  output_.append(tail_, 0, tail_pos_);
+  std::string().swap(tail_);
+  tail_pos_ = 0;
+}
+
 void Test::PrintGtestFormat() {
   ColoredPrintf(COLOR_GREEN, "[ RUN      ]");
   printf(" %s\n", name_.c_str());
-  printf("%s", output_.c_str());
+  PrintOutput();
 
   switch (result_) {
     case TEST_PASS:
@@ -97,6 +396,8 @@ void Test::Print(bool gtest_format) {
       break;
     case TEST_NONE:
       LOG(FATAL) << "Test result is TEST_NONE, this should not be possible.";
+    case TEST_NOT_RUN:
+      LOG(FATAL) << "Test result is TEST_NOT_RUN, this should not be possible.";
   }
 
   printf(" %s", name_.c_str());
@@ -105,31 +406,100 @@ void Test::Print(bool gtest_format) {
   }
   printf("\n");
 
-  printf("%s", output_.c_str());
+  PrintOutput();
   fflush(stdout);
 }
 
-bool Test::Read() {
-  char buffer[2048];
-  ssize_t bytes = TEMP_FAILURE_RETRY(read(fd_, buffer, sizeof(buffer) - 1));
-  if (bytes < 0) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      // Reading would block. Since this is not an error keep going.
-      return true;
+ssize_t Test::ReadChunk() {
+  output_reads_++;
+  if (log_fd_ != -1) {
+    return MoveToLog();
+  }
+  char buffer[65536];
+  ssize_t bytes = TEMP_FAILURE_RETRY(read(fd_, buffer, sizeof(buffer)));
+  if (bytes > 0) {
+    output_bytes_ += bytes;
+    AddOutput(buffer, bytes);
+  }
+  return bytes;
+}
+
+ssize_t Test::MoveToLog() {
+  ssize_t bytes;
+#if defined(__linux__)
+  // The output goes from the pipe to the file without being copied.
+  bytes = TEMP_FAILURE_RETRY(
+      splice(fd_, nullptr, log_fd_, nullptr, kLogChunkSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+  if (bytes == -1 && errno == EINVAL) {
+    // The file system of the log file does not support splice.
+#endif
+    char buffer[65536];
+    bytes = TEMP_FAILURE_RETRY(read(fd_, buffer, sizeof(buffer)));
+    if (bytes > 0 && !android::base::WriteFully(log_fd_, buffer, bytes)) {
+      PLOG(FATAL) << "Unexpected failure writing the log file " << log_path_;
     }
-    PLOG(FATAL) << "Unexpected failure from read";
-    return false;
+#if defined(__linux__)
   }
+#endif
+  if (bytes > 0) {
+    log_size_ += bytes;
+    output_bytes_ += bytes;
+  }
+  return bytes;
+}
 
-  if (bytes == 0) {
-    return false;
+bool Test::Read() {
+  size_t total = 0;
+  while (total < kMaxReadSize) {
+    ssize_t bytes = ReadChunk();
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Reading would block. Since this is not an error keep going.
+        return true;
+      }
+      PLOG(FATAL) << "Unexpected failure from read";
+      return false;
+    }
+
+    if (bytes == 0) {
+      return false;
+    }
+    total += bytes;
   }
-  buffer[bytes] = '\0';
-  output_ += buffer;
   return true;
 }
 
+void Test::ReadAvailable() {
+  if (output_in_file_) {
+    // Everything written so far is part of the output.
+    struct stat st;
+    if (fstat(fd_, &st) == -1) {
+      PLOG(FATAL) << "Unexpected failure from fstat";
+    }
+    output_end_ = st.st_size;
+    return;
+  }
+  while (fd_ != -1) {
+    ssize_t bytes = ReadChunk();
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      PLOG(FATAL) << "Unexpected failure from read";
+    }
+    if (bytes == 0) {
+      // The end of file is handled by the next Read.
+      return;
+    }
+  }
+}
+
 void Test::ReadUntilClosed() {
+  if (output_in_file_) {
+    // The file stays open until the output is printed or loaded.
+    ReadAvailable();
+    return;
+  }
   uint64_t start_ns = NanoTime();
   while (fd_ != -1) {
     if (!Read()) {
@@ -147,6 +517,20 @@ void Test::ReadUntilClosed() {
 void Test::SetResultFromOutput() {
   result_ = TEST_PASS;
 
+  if (output_in_file_) {
+    // Only load the output of a test that might have been skipped.
+    char head[kSkipCheckSize];
+    size_t size = std::min<off_t>(sizeof(head), output_end_ - output_begin_);
+    ssize_t bytes = TEMP_FAILURE_RETRY(pread(fd_, head, size, output_begin_));
+    if (bytes == -1) {
+      PLOG(FATAL) << "Unexpected failure from pread";
+    }
+    if (std::string(head, bytes).find("\nSkipped\n") == std::string::npos) {
+      return;
+    }
+    LoadOutput();
+  }
+
   // Need to parse the output to determine if this test was skipped.
   // Format of a skipped test:
   //   <filename>:(<line_number>) Failure in test <testname>
@@ -16,11 +16,17 @@
 
 #pragma once
 
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
 #include <string>
 #include <tuple>
 
 #include <android-base/unique_fd.h>
 
+#include "Compress.h"
+
 namespace android {
 namespace gtest_extras {
 
@@ -32,6 +38,8 @@ enum TestResult : uint8_t {
   TEST_XFAIL,
   TEST_TIMEOUT,
   TEST_SKIPPED,
+  // The test was not run because too many tests failed.
+  TEST_NOT_RUN,
 };
 
 class Test {
@@ -40,21 +48,83 @@ class Test {
 
   void PrintGtestFormat();
 
+  void PrintOutput();
+
   void Print(bool gtest_format);
 
   void Stop();
 
   bool Read();
 
+  void ReadAvailable();
+
   void ReadUntilClosed();
 
   void CloseFd();
 
+  int ReleaseFd() { return fd_.release(); }
+
   void SetResultFromOutput();
 
+  // Output that is in a file stays there, the appended output follows it.
   void AppendOutput(std::string& output) { output_ += output; }
   void AppendOutput(const char* output) { output_ += output; }
 
+  // The fd is a file that the child writes to instead of a pipe, and the
+  // output of this test starts at offset in it. The output stays in the
+  // file until it is printed or loaded.
+  void SetOutputFile(off_t offset);
+  bool output_in_file() const { return output_in_file_; }
+  off_t output_end() const { return output_end_; }
+
+  // Reads the output that is still in the file into output().
+  void LoadOutput();
+
+  // The output was appended to the spool file at offset, and is not kept
+  // in memory anymore. The spool file is owned by the caller.
+  void SpoolOutput(int spool_fd, off_t offset);
+  bool output_spooled() const { return spool_fd_ != -1; }
+
+  // Only the first and the last limit bytes of the output are kept, the
+  // rest is replaced by a marker. 0 keeps all of the output.
+  void set_output_limit(size_t limit) { output_limit_ = limit; }
+
+  // All of the output of this test goes to the log file at path, which
+  // takes the place of the output in memory. The fd is owned by the test.
+  void SetLogFile(int fd, const std::string& path);
+  bool output_in_log() const { return output_in_file_ && !log_path_.empty(); }
+
+  // Called once all output was read, joins the end that was kept to the
+  // start of the output, or switches to the log file.
+  void FinishOutput();
+
+  // Frees the output, wherever it is.
+  void DropOutput();
+
+  // Compresses the output that is in memory.
+  void CompressOutput();
+  const CompressedOutput* compressed_output() const { return compressed_.get(); }
+
+  // The output of this test is the output of original, with the name of
+  // this test in place of the name of the original. The memory of the
+  // output is freed, and the original must outlive this test.
+  void ShareOutput(const Test* original);
+  const Test* shared_output() const { return shared_output_; }
+
+  // Like ReadOutput, with every occurrence of the name of this test
+  // replaced by name.
+  void ReadOutputAs(const std::string& name,
+                    const std::function<void(const char*, size_t)>& fn) const;
+
+  // A hash of the failure, which is the same for tests that failed in the
+  // same place for the same reason. 0 if it was not computed.
+  uint64_t fingerprint() const { return fingerprint_; }
+  void set_fingerprint(uint64_t fingerprint) { fingerprint_ = fingerprint; }
+
+  // Calls fn with the output piece by piece, reading it from the file it is
+  // in if it is not in memory.
+  void ReadOutput(const std::function<void(const char*, size_t)>& fn) const;
+
   uint64_t RunTimeNs() const { return end_ns_ - start_ns_; }
   uint64_t ElapsedNs(uint64_t cur_ns) const { return cur_ns - start_ns_; }
 
@@ -80,9 +150,52 @@ class Test {
   void set_slow(bool slow) { slow_ = slow; }
   bool slow() const { return slow_; }
 
+  void set_oom_killed(bool oom_killed) { oom_killed_ = oom_killed; }
+  bool oom_killed() const { return oom_killed_; }
+
+  // The count of OOM kills when the test started, only a later kill can be
+  // the one that killed it.
+  uint64_t oom_kill_count() const { return oom_kill_count_; }
+  void set_oom_kill_count(uint64_t oom_kill_count) { oom_kill_count_ = oom_kill_count; }
+
+  // The number of earlier runs of this test that failed in this iteration.
+  size_t retry_count() const { return retry_count_; }
+  void set_retry_count(size_t retry_count) { retry_count_ = retry_count; }
+
+  // The output read from the pipe of this test, and the number of system
+  // calls it took.
+  uint64_t output_bytes() const { return output_bytes_; }
+  uint64_t output_reads() const { return output_reads_; }
+
+  // The output is not read while the test writes it too fast, this is how
+  // long that lasted in total.
+  void PauseOutput(uint64_t now_ns) { output_paused_since_ns_ = now_ns; }
+  void ResumeOutput(uint64_t now_ns) {
+    if (output_paused_since_ns_ != 0) {
+      output_paused_ns_ += now_ns - output_paused_since_ns_;
+      output_paused_since_ns_ = 0;
+    }
+  }
+  uint64_t output_paused_ns() const { return output_paused_ns_; }
+
+  uint64_t peak_rss_kb() const { return peak_rss_kb_; }
+  void set_peak_rss_kb(uint64_t peak_rss_kb) { peak_rss_kb_ = peak_rss_kb; }
+
+  // Only what was appended if the output is in a file, see ReadOutput.
   const std::string& output() const { return output_; }
 
  private:
+  void AddOutput(const char* data, size_t size);
+
+  // Reads from the pipe once, returns what read returns.
+  ssize_t ReadChunk();
+
+  ssize_t MoveToLog();
+
+  // The part of the output in the file that is dropped because of the
+  // output limit, empty if nothing is dropped.
+  void KeptFileRange(off_t* head_end, off_t* tail_begin) const;
+
   std::string suite_name_;
   std::string test_name_;
   std::string name_;
@@ -93,9 +206,35 @@ class Test {
   uint64_t start_ns_;
   uint64_t end_ns_ = 0;
   bool slow_ = false;
+  bool oom_killed_ = false;
+  uint64_t oom_kill_count_ = 0;
+  size_t retry_count_ = 0;
+  uint64_t peak_rss_kb_ = 0;
+  uint64_t output_bytes_ = 0;
+  uint64_t output_reads_ = 0;
+  uint64_t output_paused_ns_ = 0;
+  uint64_t output_paused_since_ns_ = 0;
 
   TestResult result_ = TEST_NONE;
   std::string output_;
+  bool output_in_file_ = false;
+  off_t output_begin_ = 0;
+  off_t output_end_ = 0;
+  int spool_fd_ = -1;
+  std::unique_ptr<CompressedOutput> compressed_;
+  const Test* shared_output_ = nullptr;
+  uint64_t fingerprint_ = 0;
+  size_t output_limit_ = 0;
+  // The end of the output once it goes past the limit, and how much of the
+  // output in between was dropped.
+  std::string tail_;
+  size_t tail_pos_ = 0;
+  uint64_t dropped_bytes_ = 0;
+  // The log file is only open while the output is written and until it is
+  // printed, it is opened again if the output is needed after that.
+  android::base::unique_fd log_fd_;
+  std::string log_path_;
+  off_t log_size_ = 0;
 };
 
 }  // namespace gtest_extras
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <elf.h>
+#include <link.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
+#include "TimingDb.h"
+
+namespace android {
+namespace gtest_extras {
+
+struct TimingDbHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t window_size;
+  uint32_t record_size;
+  uint64_t record_count;
+};
+
+static constexpr char kMagic[4] = {'G', 'T', 'D', 'B'};
+static constexpr uint32_t kVersion = 1;
+
+static uint64_t Fnv1aHash(const std::string& data, uint64_t hash = 0xcbf29ce484222325ULL) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+TimingDb::TimingDb(const std::string& path, const std::string& binary_id)
+    : path_(path), binary_hash_(BinaryHash(binary_id)) {}
+
+TimingDb::~TimingDb() {
+  Unmap();
+}
+
+void TimingDb::Unmap() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+  }
+  map_ = nullptr;
+  map_size_ = 0;
+  records_ = nullptr;
+  record_count_ = 0;
+}
+
+void TimingDb::Load() {
+  Unmap();
+  android::base::unique_fd fd(open(path_.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(TimingDbHeader)) {
+    return;
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  map_ = map;
+  map_size_ = st.st_size;
+
+  const TimingDbHeader* header = reinterpret_cast<const TimingDbHeader*>(map_);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kVersion ||
+      header->window_size != kWindowSize || header->record_size != sizeof(Record) ||
+      map_size_ != sizeof(TimingDbHeader) + header->record_count * sizeof(Record)) {
+    Unmap();
+    return;
+  }
+  records_ = reinterpret_cast<const Record*>(header + 1);
+  record_count_ = header->record_count;
+}
+
+uint64_t TimingDb::Key(uint64_t binary_hash, const std::string& test_name) {
+  return Fnv1aHash(test_name, binary_hash);
+}
+
+uint64_t TimingDb::BinaryHash(const std::string& binary_id) {
+  return Fnv1aHash(binary_id);
+}
+
+const TimingDb::Record* TimingDb::Find(uint64_t binary_hash, const std::string& test_name) const {
+  uint64_t key = Key(binary_hash, test_name);
+  const Record* end = records_ + record_count_;
+  const Record* record = std::lower_bound(
+      records_, end, key, [](const Record& record, uint64_t key) { return record.key < key; });
+  if (record == end || record->key != key) {
+    return nullptr;
+  }
+  return record;
+}
+
+void TimingDb::Add(uint64_t binary_hash, const std::string& test_name, uint64_t duration_ms,
+                   TestResult result, uint64_t peak_rss_kb) {
+  Sample sample = {
+      .duration_ms = static_cast<uint32_t>(std::min<uint64_t>(duration_ms, UINT32_MAX)),
+      .peak_rss_kb = static_cast<uint32_t>(std::min<uint64_t>(peak_rss_kb, UINT32_MAX)),
+      .result = result,
+  };
+  pending_.emplace_back(Key(binary_hash, test_name), sample);
+}
+
+bool TimingDb::Write() {
+  // Serialize with other runners updating the same file, and merge into
+  // whatever they wrote last.
+  android::base::unique_fd lock_fd(
+      open((path_ + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+  if (lock_fd == -1 || TEMP_FAILURE_RETRY(flock(lock_fd, LOCK_EX)) == -1) {
+    return false;
+  }
+  Load();
+
+  // Samples for the same key stay in the order they were added.
+  std::stable_sort(pending_.begin(), pending_.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+  std::vector<Record> records;
+  records.reserve(record_count_ + pending_.size());
+  size_t index = 0;
+  for (auto sample = pending_.begin(); sample != pending_.end(); ++sample) {
+    while (index < record_count_ && records_[index].key < sample->first) {
+      records.push_back(records_[index++]);
+    }
+    if (records.empty() || records.back().key != sample->first) {
+      if (index < record_count_ && records_[index].key == sample->first) {
+        records.push_back(records_[index++]);
+      } else {
+        Record record = {};
+        record.key = sample->first;
+        records.push_back(record);
+      }
+    }
+    Record* record = &records.back();
+    record->duration_ms[record->next] = sample->second.duration_ms;
+    record->peak_rss_kb[record->next] = sample->second.peak_rss_kb;
+    record->result[record->next] = sample->second.result;
+    record->next = (record->next + 1) % kWindowSize;
+    record->count = std::min<uint32_t>(record->count + 1, kWindowSize);
+  }
+  records.insert(records.end(), records_ + index, records_ + record_count_);
+
+  TimingDbHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.window_size = kWindowSize;
+  header.record_size = sizeof(Record);
+  header.record_count = records.size();
+
+  std::string tmp_path(path_ + ".tmp");
+  android::base::unique_fd fd(
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (fd == -1) {
+    return false;
+  }
+  if (!android::base::WriteFully(fd, &header, sizeof(header)) ||
+      !android::base::WriteFully(fd, records.data(), records.size() * sizeof(Record)) ||
+      fsync(fd) == -1 || rename(tmp_path.c_str(), path_.c_str()) == -1) {
+    int saved_errno = errno;
+    unlink(tmp_path.c_str());
+    errno = saved_errno;
+    return false;
+  }
+  pending_.clear();
+  Load();
+  return true;
+}
+
+uint64_t TimingDb::AverageDurationMs(const Record& record) {
+  if (record.count == 0) {
+    return 0;
+  }
+  uint64_t total_ms = 0;
+  for (size_t i = 0; i < record.count; i++) {
+    total_ms += record.duration_ms[i];
+  }
+  return total_ms / record.count;
+}
+
+#if defined(__linux__)
+// Returns the hex GNU build id in the notes [note, end), or an empty string.
+static std::string FindBuildIdNote(const char* note, const char* end, size_t align) {
+  while (note + sizeof(ElfW(Nhdr)) <= end) {
+    const ElfW(Nhdr)* nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+    const char* name = note + sizeof(ElfW(Nhdr));
+    size_t name_size = (nhdr->n_namesz + align - 1) & ~(align - 1);
+    const unsigned char* desc = reinterpret_cast<const unsigned char*>(name + name_size);
+    if (reinterpret_cast<const char*>(desc) + nhdr->n_descsz > end) {
+      break;
+    }
+    if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+      std::string build_id;
+      for (size_t j = 0; j < nhdr->n_descsz; j++) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", desc[j]);
+        build_id += hex;
+      }
+      return build_id;
+    }
+    note = reinterpret_cast<const char*>(desc) + ((nhdr->n_descsz + align - 1) & ~(align - 1));
+  }
+  return "";
+}
+
+static int FindBuildId(dl_phdr_info* info, size_t, void* data) {
+  std::string* build_id = reinterpret_cast<std::string*>(data);
+  for (size_t i = 0; i < info->dlpi_phnum && build_id->empty(); i++) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_NOTE) {
+      const char* note = reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr);
+      *build_id = FindBuildIdNote(note, note + phdr.p_memsz, phdr.p_align == 8 ? 8 : 4);
+    }
+  }
+  // The first object is the executable, do not look at any libraries.
+  return 1;
+}
+#endif
+
+static std::string PathId(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    return path;
+  }
+  return path + ':' + std::to_string(st.st_mtime);
+}
+
+std::string TimingDb::GetBinaryId() {
+#if defined(__linux__)
+  std::string build_id;
+  dl_iterate_phdr(FindBuildId, &build_id);
+  if (!build_id.empty()) {
+    return "build-id:" + build_id;
+  }
+#endif
+  return PathId(android::base::GetExecutablePath());
+}
+
+std::string TimingDb::GetBinaryId(const std::string& path) {
+#if defined(__linux__)
+  // Read the notes from the program headers of the file, the same ones
+  // dl_iterate_phdr finds in a running executable.
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  ElfW(Ehdr) ehdr;
+  if (fd != -1 && TEMP_FAILURE_RETRY(pread(fd, &ehdr, sizeof(ehdr), 0)) == sizeof(ehdr) &&
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 && ehdr.e_phentsize == sizeof(ElfW(Phdr))) {
+    for (size_t i = 0; i < ehdr.e_phnum; i++) {
+      ElfW(Phdr) phdr;
+      if (TEMP_FAILURE_RETRY(pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr))) !=
+          sizeof(phdr)) {
+        break;
+      }
+      // Build id notes are small, do not read anything large.
+      if (phdr.p_type != PT_NOTE || phdr.p_filesz > 4096) {
+        continue;
+      }
+      std::string notes(phdr.p_filesz, '\0');
+      if (TEMP_FAILURE_RETRY(pread(fd, &notes[0], notes.size(), phdr.p_offset)) !=
+          static_cast<ssize_t>(notes.size())) {
+        continue;
+      }
+      std::string build_id(FindBuildIdNote(notes.data(), notes.data() + notes.size(),
+                                           phdr.p_align == 8 ? 8 : 4));
+      if (!build_id.empty()) {
+        return "build-id:" + build_id;
+      }
+    }
+  }
+#endif
+  return PathId(path);
+}
+
+}  // namespace gtest_extras
+}  // namespace android
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Test.h"
+
+namespace android {
+namespace gtest_extras {
+
+// The recent history of every test, kept in a file across runs.
+//
+// The file is a header followed by fixed size records in host byte order,
+// sorted by key. The key is a hash of the test binary identity and the test
+// name, so one file can hold the history of any number of binaries. The
+// file is read through mmap and replaced atomically on every update.
+class TimingDb {
+ public:
+  static constexpr size_t kWindowSize = 8;
+
+  struct Record {
+    uint64_t key;
+    // The number of valid samples, up to kWindowSize.
+    uint32_t count;
+    // Where the next sample goes, the oldest sample once the window is full.
+    uint32_t next;
+    uint32_t duration_ms[kWindowSize];
+    uint32_t peak_rss_kb[kWindowSize];
+    uint8_t result[kWindowSize];
+  };
+
+  TimingDb(const std::string& path, const std::string& binary_id);
+  ~TimingDb();
+
+  // A missing or invalid file is treated as an empty history.
+  void Load();
+
+  // Returns nullptr if the test has no history. The record is only valid
+  // until the next Load or Write.
+  const Record* Find(const std::string& test_name) const {
+    return Find(binary_hash_, test_name);
+  }
+
+  void Add(const std::string& test_name, uint64_t duration_ms, TestResult result,
+           uint64_t peak_rss_kb) {
+    Add(binary_hash_, test_name, duration_ms, result, peak_rss_kb);
+  }
+
+  // The same for a test of another binary than the one the database was
+  // created for, identified by the BinaryHash of its id.
+  const Record* Find(uint64_t binary_hash, const std::string& test_name) const;
+
+  void Add(uint64_t binary_hash, const std::string& test_name, uint64_t duration_ms,
+           TestResult result, uint64_t peak_rss_kb);
+
+  // Adds the samples from Add to the latest version of the file. On failure
+  // errno is set and the file is left unchanged.
+  bool Write();
+
+  size_t record_count() const { return record_count_; }
+
+  static uint64_t AverageDurationMs(const Record& record);
+
+  // The build id of the running executable, or its path and modification
+  // time if it has no build id.
+  static std::string GetBinaryId();
+
+  // The same for the executable at path, which is not running. An
+  // executable gets the same id either way.
+  static std::string GetBinaryId(const std::string& path);
+
+  static uint64_t BinaryHash(const std::string& binary_id);
+
+ private:
+  struct Sample {
+    uint32_t duration_ms;
+    uint32_t peak_rss_kb;
+    uint8_t result;
+  };
+
+  static uint64_t Key(uint64_t binary_hash, const std::string& test_name);
+
+  void Unmap();
+
+  std::string path_;
+  uint64_t binary_hash_;
+
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  const Record* records_ = nullptr;
+  size_t record_count_ = 0;
+
+  // Samples added since the last Write, by key.
+  std::vector<std::pair<uint64_t, Sample>> pending_;
+};
+
+}  // namespace gtest_extras
+}  // namespace android
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include "XmlWriter.h"
+
+namespace android {
+namespace gtest_extras {
+
+static const char* XmlEntity(char c) {
+  switch (c) {
+    case '<':
+      return "&lt;";
+    case '>':
+      return "&gt;";
+    case '&':
+      return "&amp;";
+    case '\'':
+      return "&apos;";
+    case '"':
+      return "&quot;";
+    default:
+      return nullptr;
+  }
+}
+
+void XmlEscape(const char* data, size_t size, std::string* out) {
+  size_t start = 0;
+  for (size_t i = 0; i < size; i++) {
+    const char* entity = XmlEntity(data[i]);
+    if (entity != nullptr) {
+      out->append(&data[start], i - start);
+      out->append(entity);
+      start = i + 1;
+    }
+  }
+  out->append(&data[start], size - start);
+}
+
+std::string XmlEscape(const std::string& xml) {
+  std::string escaped;
+  escaped.reserve(xml.size());
+  XmlEscape(xml.data(), xml.size(), &escaped);
+  return escaped;
+}
+
+bool XmlWriter::Open(const std::string& path, const std::string& trailer) {
+  // Readable too, so that the file can be copied from with AppendRange.
+  fd_.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)));
+  if (fd_ == -1) {
+    return false;
+  }
+  path_ = path;
+  trailer_ = trailer;
+  buffer_.clear();
+  buffer_.reserve(kXmlBufferSize);
+  size_ = 0;
+  record_ns_ = 0;
+  partial_ = false;
+  return true;
+}
+
+void XmlWriter::Append(const char* data, size_t size) {
+  buffer_.append(data, size);
+  if (buffer_.size() >= kXmlBufferSize) {
+    Write(buffer_.data(), buffer_.size());
+    buffer_.clear();
+    partial_ = true;
+  }
+}
+
+void XmlWriter::AppendEscaped(const char* data, size_t size) {
+  // Escape a piece at a time, so that large data is not escaped into a
+  // buffer much larger than kXmlBufferSize.
+  for (size_t offset = 0; offset < size; offset += kXmlBufferSize) {
+    XmlEscape(&data[offset], std::min(kXmlBufferSize, size - offset), &buffer_);
+    if (buffer_.size() >= kXmlBufferSize) {
+      Write(buffer_.data(), buffer_.size());
+      buffer_.clear();
+      partial_ = true;
+    }
+  }
+}
+
+void XmlWriter::AppendRange(int fd, off_t begin, off_t end) {
+  while (begin < end) {
+    size_t used = buffer_.size();
+    size_t size = std::min(kXmlBufferSize, static_cast<size_t>(end - begin));
+    buffer_.resize(used + size);
+    ssize_t bytes = TEMP_FAILURE_RETRY(pread(fd, &buffer_[used], size, begin));
+    if (bytes <= 0) {
+      PLOG(FATAL) << "Unexpected failure reading xml from " << path_;
+    }
+    buffer_.resize(used + bytes);
+    begin += bytes;
+    if (buffer_.size() >= kXmlBufferSize) {
+      Write(buffer_.data(), buffer_.size());
+      buffer_.clear();
+      partial_ = true;
+    }
+  }
+}
+
+void XmlWriter::EndRecord(uint64_t now_ns) {
+  if (record_ns_ == 0) {
+    record_ns_ = now_ns;
+  }
+  if (partial_ || buffer_.size() >= kXmlBufferSize / 2 || now_ns >= flush_ns()) {
+    Flush();
+  }
+}
+
+void XmlWriter::Flush() {
+  Write(buffer_.data(), buffer_.size());
+  buffer_.clear();
+  // The trailer is not part of the size, the next write replaces it.
+  off_t size = size_;
+  Write(trailer_.data(), trailer_.size());
+  size_ = size;
+  record_ns_ = 0;
+  partial_ = false;
+}
+
+void XmlWriter::Close() {
+  if (fd_ != -1) {
+    Flush();
+    fd_.reset();
+  }
+}
+
+void XmlWriter::Write(const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes = TEMP_FAILURE_RETRY(pwrite(fd_.get(), data, size, size_));
+    if (bytes == -1) {
+      PLOG(FATAL) << "Unexpected failure writing " << path_;
+    }
+    data += bytes;
+    size -= bytes;
+    size_ += bytes;
+  }
+}
+
+}  // namespace gtest_extras
+}  // namespace android
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace gtest_extras {
+
+// How much is buffered before it is written to the file.
+constexpr size_t kXmlBufferSize = 1024 * 1024;
+
+// How long a complete record can stay in the buffer.
+constexpr uint64_t kXmlFlushIntervalNs = 1000000000ULL;
+
+// Appends data to out with the characters that are special in xml escaped,
+// copying the runs of characters that need no escaping in one go.
+void XmlEscape(const char* data, size_t size, std::string* out);
+
+std::string XmlEscape(const std::string& xml);
+
+// Writes an xml file through a large buffer. The file is written as it
+// goes, and every write ends with the trailer, the closing tags of what was
+// written so far, which the next write overwrites. This way the file holds
+// complete xml even if the process writing it is killed.
+class XmlWriter {
+ public:
+  // Creates or truncates the file. Returns false and sets errno on failure.
+  bool Open(const std::string& path, const std::string& trailer);
+
+  void Append(const char* data, size_t size);
+  void Append(const std::string& data) { Append(data.data(), data.size()); }
+
+  void AppendEscaped(const char* data, size_t size);
+
+  // Appends the range [begin, end) of the file fd.
+  void AppendRange(int fd, off_t begin, off_t end);
+
+  // Marks the end of a complete record. The buffer is written once it is
+  // half full, or when the oldest record in it is kXmlFlushIntervalNs old.
+  void EndRecord(uint64_t now_ns);
+
+  // Writes everything appended so far followed by the trailer.
+  void Flush();
+
+  // When the records in the buffer are due to be written, UINT64_MAX if
+  // there are none.
+  uint64_t flush_ns() const {
+    return record_ns_ == 0 ? UINT64_MAX : record_ns_ + kXmlFlushIntervalNs;
+  }
+
+  void Close();
+
+  // The offset in the file of the next byte appended.
+  off_t offset() const { return size_ + buffer_.size(); }
+
+  int fd() const { return fd_.get(); }
+  const std::string& path() const { return path_; }
+
+ private:
+  void Write(const char* data, size_t size);
+
+  android::base::unique_fd fd_;
+  std::string path_;
+  std::string trailer_;
+  std::string buffer_;
+  // The size of the file without the trailer.
+  off_t size_ = 0;
+  // When the first record in the buffer ended, zero if there is none.
+  uint64_t record_ns_ = 0;
+  // Set when part of a record was written because it did not fit in the
+  // buffer, the file is not complete xml until that record ends.
+  bool partial_ = false;
+};
+
+}  // namespace gtest_extras
+}  // namespace android
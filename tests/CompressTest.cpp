@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "Compress.h"
+
+namespace android {
+namespace gtest_extras {
+
+static std::string RoundTrip(const std::string& data) {
+  std::string compressed;
+  CompressBlock(data.data(), data.size(), &compressed);
+  std::string decompressed(data.size(), '\0');
+  EXPECT_TRUE(DecompressBlock(compressed.data(), compressed.size(), &decompressed[0],
+                              decompressed.size()));
+  return decompressed;
+}
+
+static std::string ReadAll(const CompressedOutput& output) {
+  std::string data;
+  output.Read([&data](const char* buffer, size_t size) { data.append(buffer, size); });
+  return data;
+}
+
+TEST(CompressTest, block_empty) {
+  EXPECT_EQ("", RoundTrip(""));
+}
+
+TEST(CompressTest, block_short) {
+  EXPECT_EQ("a", RoundTrip("a"));
+  EXPECT_EQ("abcd", RoundTrip("abcd"));
+  EXPECT_EQ("abcdabc", RoundTrip("abcdabc"));
+}
+
+TEST(CompressTest, block_repeated_lines) {
+  std::string data;
+  for (size_t i = 0; i < 1000; i++) {
+    data += "[ RUN      ] Suite.test_" + std::to_string(i % 10) + "\n";
+  }
+  std::string compressed;
+  CompressBlock(data.data(), data.size(), &compressed);
+  EXPECT_GT(data.size() / 10, compressed.size());
+  EXPECT_EQ(data, RoundTrip(data));
+}
+
+TEST(CompressTest, block_overlapping_match) {
+  // A run of the same byte is a match that overlaps itself.
+  std::string data("start" + std::string(10000, 'x') + "end");
+  EXPECT_EQ(data, RoundTrip(data));
+}
+
+TEST(CompressTest, block_random) {
+  std::mt19937 random(1);
+  std::string data;
+  for (size_t i = 0; i < kCompressBlockSize; i++) {
+    data += static_cast<char>(random());
+  }
+  EXPECT_EQ(data, RoundTrip(data));
+}
+
+TEST(CompressTest, block_invalid) {
+  std::string data("0123456789012345678901234567890123456789");
+  std::string compressed;
+  CompressBlock(data.data(), data.size(), &compressed);
+  std::string decompressed(data.size(), '\0');
+  // Too small, too large and truncated.
+  EXPECT_FALSE(DecompressBlock(compressed.data(), compressed.size(), &decompressed[0],
+                               decompressed.size() - 1));
+  decompressed.resize(data.size() + 1);
+  EXPECT_FALSE(DecompressBlock(compressed.data(), compressed.size(), &decompressed[0],
+                               decompressed.size()));
+  decompressed.resize(data.size());
+  EXPECT_FALSE(DecompressBlock(compressed.data(), compressed.size() - 1, &decompressed[0],
+                               decompressed.size()));
+
+  // An offset before the start of the block.
+  std::string bad("\x01"
+                  "a"
+                  "\x02\x00\x00",
+                  5);
+  decompressed.resize(5);
+  EXPECT_FALSE(DecompressBlock(bad.data(), bad.size(), &decompressed[0], decompressed.size()));
+}
+
+TEST(CompressTest, output_multiple_blocks) {
+  std::string data;
+  for (size_t i = 0; data.size() < 3 * kCompressBlockSize + 100; i++) {
+    data += "Line " + std::to_string(i) + " of the output of a test.\n";
+  }
+  CompressedOutput output(data.data(), data.size());
+  EXPECT_EQ(data.size(), output.size());
+  EXPECT_GT(data.size() / 2, output.compressed_size());
+
+  size_t calls = 0;
+  output.Read([&calls](const char*, size_t size) {
+    EXPECT_GE(kCompressBlockSize, size);
+    calls++;
+  });
+  EXPECT_EQ(4U, calls);
+  EXPECT_EQ(data, ReadAll(output));
+}
+
+TEST(CompressTest, output_incompressible) {
+  std::mt19937 random(2);
+  std::string data;
+  for (size_t i = 0; i < kCompressBlockSize + 10; i++) {
+    data += static_cast<char>(random());
+  }
+  CompressedOutput output(data.data(), data.size());
+  // Blocks that do not get smaller are stored as is.
+  EXPECT_EQ(data.size() + 4 * sizeof(uint32_t), output.compressed_size());
+  EXPECT_EQ(data, ReadAll(output));
+}
+
+}  // namespace gtest_extras
+}  // namespace android
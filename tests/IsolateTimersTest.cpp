@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Isolate.h"
+#include "NanoTime.h"
+#include "Options.h"
+#include "Test.h"
+
+namespace android {
+namespace gtest_extras {
+
+// No process has these pids, so a test that reaches its deadline is killed
+// without harm.
+constexpr pid_t kFakePid = 0x7fff0000;
+
+class IsolateTimersTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::vector<const char*> args{"ignore"};
+    std::vector<const char*> child_args;
+    ASSERT_TRUE(options_.Process(args, &child_args));
+    isolate_.reset(new Isolate(options_, child_args));
+    SetThresholds(1000 * kNsPerS, 1000 * kNsPerS);
+  }
+
+  void SetThresholds(uint64_t slow_ns, uint64_t deadline_ns) {
+    isolate_->slow_threshold_ns_ = slow_ns;
+    isolate_->deadline_threshold_ns_ = deadline_ns;
+  }
+
+  // Starts a test in a process that does not exist.
+  android::gtest_extras::Test* Start(size_t index) {
+    std::tuple<std::string, std::string> name("Suite.", "test" + std::to_string(index));
+    auto* test = new android::gtest_extras::Test(name, index, index, -1);
+    isolate_->running_by_pid_[kFakePid + index].reset(test);
+    isolate_->AddTimers(kFakePid + index, test);
+    return test;
+  }
+
+  void Finish(size_t index) { isolate_->running_by_pid_.erase(kFakePid + index); }
+
+  void CheckTestsTimeout() { isolate_->CheckTestsTimeout(); }
+
+  uint64_t NextTimerNs() { return isolate_->NextTimerNs(); }
+
+  // What every pass of the loop did before the timers were kept in a heap:
+  // look at every running test to find the next timer.
+  uint64_t ScanNextTimerNs() {
+    uint64_t now_ns = NanoTime();
+    uint64_t wake_ns = UINT64_MAX;
+    for (const auto& entry : isolate_->running_by_pid_) {
+      auto* test = entry.second.get();
+      if (test->result() == TEST_TIMEOUT) {
+        continue;
+      }
+      uint64_t run_ns = now_ns - test->start_ns();
+      if (run_ns >= isolate_->deadline_threshold_ns_) {
+        test->set_result(TEST_TIMEOUT);
+        continue;
+      }
+      if (!test->slow() && run_ns >= isolate_->slow_threshold_ns_) {
+        test->set_slow(true);
+      }
+      wake_ns = std::min(wake_ns, test->start_ns() + isolate_->deadline_threshold_ns_);
+      if (!test->slow()) {
+        wake_ns = std::min(wake_ns, test->start_ns() + isolate_->slow_threshold_ns_);
+      }
+    }
+    return wake_ns;
+  }
+
+  Options options_;
+  std::unique_ptr<Isolate> isolate_;
+};
+
+TEST_F(IsolateTimersTest, next_timer) {
+  EXPECT_EQ(UINT64_MAX, NextTimerNs());
+  SetThresholds(2 * kNsPerS, 10 * kNsPerS);
+  auto* test = Start(0);
+  EXPECT_EQ(test->start_ns() + 2 * kNsPerS, NextTimerNs());
+  Finish(0);
+  // The timers of a finished test are dropped.
+  EXPECT_EQ(UINT64_MAX, NextTimerNs());
+}
+
+TEST_F(IsolateTimersTest, slow) {
+  SetThresholds(0, 1000 * kNsPerS);
+  auto* test = Start(0);
+  CheckTestsTimeout();
+  EXPECT_TRUE(test->slow());
+  EXPECT_EQ(TEST_NONE, test->result());
+  EXPECT_EQ(test->start_ns() + 1000 * kNsPerS, NextTimerNs());
+}
+
+TEST_F(IsolateTimersTest, deadline) {
+  SetThresholds(0, 0);
+  auto* test = Start(0);
+  CheckTestsTimeout();
+  EXPECT_FALSE(test->slow());
+  EXPECT_EQ(TEST_TIMEOUT, test->result());
+  EXPECT_EQ(UINT64_MAX, NextTimerNs());
+}
+
+TEST_F(IsolateTimersTest, timers_of_restarted_test) {
+  SetThresholds(0, 1000 * kNsPerS);
+  auto* test = Start(0);
+  Finish(0);
+  // The same test runs again in a process with the same pid, the timers of
+  // the previous run do not apply to it.
+  SetThresholds(1000 * kNsPerS, 1000 * kNsPerS);
+  test = Start(0);
+  CheckTestsTimeout();
+  EXPECT_FALSE(test->slow());
+  EXPECT_EQ(test->start_ns() + 1000 * kNsPerS, NextTimerNs());
+}
+
+// Not run by default. Measures one pass of the loop over the timers with
+// 1024 tests running and no timer expiring, against scanning the tests.
+TEST_F(IsolateTimersTest, DISABLED_benchmark_1024_slots) {
+  constexpr size_t kSlots = 1024;
+  constexpr size_t kPasses = 20000;
+  for (size_t i = 0; i < kSlots; i++) {
+    Start(i);
+  }
+
+  uint64_t wake_ns = 0;
+  uint64_t start_ns = NanoTime();
+  for (size_t i = 0; i < kPasses; i++) {
+    wake_ns += ScanNextTimerNs();
+  }
+  uint64_t scan_ns = NanoTime() - start_ns;
+
+  start_ns = NanoTime();
+  for (size_t i = 0; i < kPasses; i++) {
+    CheckTestsTimeout();
+    wake_ns -= NextTimerNs();
+  }
+  uint64_t heap_ns = NanoTime() - start_ns;
+
+  // Both find the same timers.
+  EXPECT_EQ(0U, wake_ns);
+  printf("%zu slots, %zu passes: scan %.3f us per pass, heap %.3f us per pass\n", kSlots,
+         kPasses, static_cast<double>(scan_ns) / kPasses / 1000,
+         static_cast<double>(heap_ns) / kPasses / 1000);
+}
+
+}  // namespace gtest_extras
+}  // namespace android
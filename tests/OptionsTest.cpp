@@ -71,16 +71,40 @@ TEST(OptionsTest, check_defaults) {
   EXPECT_LT(0U, options.job_count());
   EXPECT_EQ(90000ULL, options.deadline_threshold_ms());
   EXPECT_EQ(2000ULL, options.slow_threshold_ms());
+  EXPECT_EQ(1ULL, options.batch_size());
+  EXPECT_EQ(0ULL, options.prefork());
+  EXPECT_EQ(0ULL, options.max_memory_pressure());
+  EXPECT_EQ(0ULL, options.min_available_memory_mb());
+  EXPECT_FALSE(options.memory_control());
+  EXPECT_EQ(0ULL, options.max_failures());
+  EXPECT_EQ(0ULL, options.retry_failed());
+  EXPECT_EQ(0ULL, options.spool_threshold_kb());
+  EXPECT_EQ(0ULL, options.output_limit_kb());
+  EXPECT_EQ(0ULL, options.max_output_rate_kb());
+  EXPECT_EQ(0.0, options.max_failure_ratio());
   EXPECT_EQ(0ULL, options.shard_index());
   EXPECT_EQ(0ULL, options.total_shards());
   EXPECT_EQ("auto", options.color());
   EXPECT_EQ("", options.xml_file());
   EXPECT_EQ("", options.filter());
+  EXPECT_EQ("", options.test_durations_file());
+  EXPECT_EQ("", options.timing_db_file());
+  EXPECT_EQ("", options.oom_kill_file());
+  EXPECT_EQ("round_robin", options.sharding());
+  EXPECT_EQ("", options.shard_durations_file());
+  EXPECT_EQ("pipe", options.output_capture());
+  EXPECT_EQ("all", options.keep_output());
+  EXPECT_EQ("", options.output_dir());
   EXPECT_EQ(1, options.num_iterations());
   EXPECT_TRUE(options.print_time());
   EXPECT_TRUE(options.gtest_format());
   EXPECT_FALSE(options.allow_disabled_tests());
   EXPECT_FALSE(options.list_tests());
+  EXPECT_FALSE(options.fork_server());
+  EXPECT_FALSE(options.fail_fast());
+  EXPECT_FALSE(options.kill_on_failure_limit());
+  EXPECT_FALSE(options.compress_output());
+  EXPECT_FALSE(options.dedupe_failures());
   EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
 }
 
@@ -289,6 +313,393 @@ TEST(OptionsTest, slow_threshold_ms_error_illegal_value) {
   EXPECT_EQ("--slow_threshold_ms requires a number greater than zero.\n", capture.str());
 }
 
+TEST(OptionsTest, batch_size) {
+  std::vector<const char*> cur_args{"ignore", "--batch_size=16"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(16ULL, options.batch_size());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, batch_size_error_no_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--batch_size"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--batch_size requires an argument.\n", capture.str());
+}
+
+TEST(OptionsTest, batch_size_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--batch_size=0"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--batch_size requires a number greater than zero.\n", capture.str());
+}
+
+TEST(OptionsTest, fork_server) {
+  std::vector<const char*> cur_args{"ignore", "--fork_server"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_TRUE(options.fork_server());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, prefork) {
+  std::vector<const char*> cur_args{"ignore", "--prefork=4"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(4ULL, options.prefork());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, prefork_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--prefork=0"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--prefork requires a number greater than zero.\n", capture.str());
+}
+
+TEST(OptionsTest, max_memory_pressure) {
+  std::vector<const char*> cur_args{"ignore", "--max_memory_pressure=50"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(50ULL, options.max_memory_pressure());
+  EXPECT_TRUE(options.memory_control());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, max_memory_pressure_off) {
+  std::vector<const char*> cur_args{"ignore", "--max_memory_pressure=50",
+                                    "--max_memory_pressure=0"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(0ULL, options.max_memory_pressure());
+  EXPECT_FALSE(options.memory_control());
+}
+
+TEST(OptionsTest, max_memory_pressure_error_not_numeric) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--max_memory_pressure=high"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--max_memory_pressure value is not formatted as a numeric value (high)\n",
+            capture.str());
+}
+
+TEST(OptionsTest, min_available_memory_mb) {
+  std::vector<const char*> cur_args{"ignore", "--min_available_memory_mb=1024"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(1024ULL, options.min_available_memory_mb());
+  EXPECT_TRUE(options.memory_control());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, min_available_memory_mb_off) {
+  std::vector<const char*> cur_args{"ignore", "--min_available_memory_mb=1024",
+                                    "--min_available_memory_mb=0"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(0ULL, options.min_available_memory_mb());
+  EXPECT_FALSE(options.memory_control());
+}
+
+TEST(OptionsTest, oom_kill_file) {
+  std::vector<const char*> cur_args{"ignore", "--oom_kill_file=/tmp/memory.events"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("/tmp/memory.events", options.oom_kill_file());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, oom_kill_file_error_no_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--oom_kill_file"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--oom_kill_file requires an argument.\n", capture.str());
+}
+
+TEST(OptionsTest, test_durations) {
+  std::vector<const char*> cur_args{"ignore", "--test_durations=/tmp/durations"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("/tmp/durations", options.test_durations_file());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, test_durations_error_no_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--test_durations"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--test_durations requires an argument.\n", capture.str());
+}
+
+TEST(OptionsTest, timing_db) {
+  std::vector<const char*> cur_args{"ignore", "--timing_db=/tmp/timing.db"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("/tmp/timing.db", options.timing_db_file());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, timing_db_error_no_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--timing_db"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--timing_db requires an argument.\n", capture.str());
+}
+
+TEST(OptionsTest, fail_fast) {
+  std::vector<const char*> cur_args{"ignore", "--fail_fast"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_TRUE(options.fail_fast());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, max_failures) {
+  std::vector<const char*> cur_args{"ignore", "--max_failures=10"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(10ULL, options.max_failures());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, max_failures_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--max_failures=0"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--max_failures requires a number greater than zero.\n", capture.str());
+}
+
+TEST(OptionsTest, max_failure_ratio) {
+  std::vector<const char*> cur_args{"ignore", "--max_failure_ratio=0.25"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(0.25, options.max_failure_ratio());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, max_failure_ratio_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--max_failure_ratio=1.5"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--max_failure_ratio requires a number greater than 0 and at most 1 (1.5)\n",
+            capture.str());
+}
+
+TEST(OptionsTest, max_failure_ratio_error_not_a_number) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--max_failure_ratio=half"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--max_failure_ratio requires a number greater than 0 and at most 1 (half)\n",
+            capture.str());
+}
+
+TEST(OptionsTest, kill_on_failure_limit) {
+  std::vector<const char*> cur_args{"ignore", "--kill_on_failure_limit"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_TRUE(options.kill_on_failure_limit());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, retry_failed) {
+  std::vector<const char*> cur_args{"ignore", "--retry_failed=2"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(2ULL, options.retry_failed());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, retry_failed_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--retry_failed=0"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--retry_failed requires a number greater than zero.\n", capture.str());
+}
+
+TEST(OptionsTest, spool_threshold_kb) {
+  std::vector<const char*> cur_args{"ignore", "--spool_threshold_kb=64"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(64ULL, options.spool_threshold_kb());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, output_limit_kb) {
+  std::vector<const char*> cur_args{"ignore", "--output_limit_kb=1024"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(1024ULL, options.output_limit_kb());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, compress_output) {
+  std::vector<const char*> cur_args{"ignore", "--compress_output"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_TRUE(options.compress_output());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, dedupe_failures) {
+  std::vector<const char*> cur_args{"ignore", "--dedupe_failures"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_TRUE(options.dedupe_failures());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, max_output_rate_kb) {
+  std::vector<const char*> cur_args{"ignore", "--max_output_rate_kb=512"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ(512ULL, options.max_output_rate_kb());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, output_dir) {
+  std::vector<const char*> cur_args{"ignore", "--output_dir=/tmp/logs"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("/tmp/logs", options.output_dir());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, output_capture) {
+  std::vector<const char*> cur_args{"ignore", "--output_capture=memfd"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("memfd", options.output_capture());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, output_capture_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--output_capture=socket"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--output_capture must be one of pipe or memfd (socket)\n", capture.str());
+}
+
+TEST(OptionsTest, keep_output) {
+  std::vector<const char*> cur_args{"ignore", "--keep_output=failures"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("failures", options.keep_output());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, keep_output_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--keep_output=some"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--keep_output must be one of all, failures or none (some)\n", capture.str());
+}
+
+TEST(OptionsTest, sharding) {
+  std::vector<const char*> cur_args{"ignore", "--sharding=balanced"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("balanced", options.sharding());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
+TEST(OptionsTest, sharding_error_illegal_value) {
+  CapturedStdout capture;
+  std::vector<const char*> cur_args{"ignore", "--sharding=random"};
+  std::vector<const char*> child_args;
+  Options options;
+  bool parsed = options.Process(cur_args, &child_args);
+  capture.Stop();
+  ASSERT_FALSE(parsed) << "Process did not fail properly.";
+  EXPECT_EQ("--sharding must be one of round_robin, balanced, hash or hash_suite (random)\n",
+            capture.str());
+}
+
+TEST(OptionsTest, shard_durations) {
+  std::vector<const char*> cur_args{"ignore", "--shard_durations=/tmp/durations"};
+  std::vector<const char*> child_args;
+  Options options;
+  ASSERT_TRUE(options.Process(cur_args, &child_args));
+  EXPECT_EQ("/tmp/durations", options.shard_durations_file());
+  EXPECT_EQ(std::vector<const char*>{"ignore"}, child_args);
+}
+
 TEST(OptionsTest, shard_index) {
   ASSERT_NE(-1, setenv("GTEST_SHARD_INDEX", "100", 1));
 
@@ -15,11 +15,13 @@
  */
 
 #include <fcntl.h>
+#include <inttypes.h>
 #if !defined(__APPLE__)
 #include <malloc.h>
 #endif
 #include <signal.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -30,11 +32,13 @@
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
 #include <gtest/gtest.h>
 
 #include "NanoTime.h"
+#include "TimingDb.h"
 
 // Change the slow threshold for these tests since a few can take around
 // 20 seconds.
@@ -54,6 +58,12 @@ class SystemTests : public ::testing::Test {
     raw_output_ = "";
     sanitized_output_ = "";
     exitcode_ = 0;
+    exe_name_ = android::base::GetExecutablePath();
+  }
+
+  // Runs the tests of the binaries with the runner instead of this binary.
+  void UseRunner() {
+    exe_name_ = android::base::GetExecutableDirectory() + "/gtest_isolated_runner";
   }
 
   void SanitizeOutput();
@@ -66,6 +76,7 @@ class SystemTests : public ::testing::Test {
   void Verify(const std::string& test_name, const std::string& expected_output,
               int expected_exitcode, std::vector<const char*> extra_args = {});
 
+  std::string exe_name_;
   std::string raw_output_;
   std::string sanitized_output_;
   int exitcode_;
@@ -110,8 +121,7 @@ void SystemTests::Exec(std::vector<const char*> args) {
     ASSERT_NE(0, dup2(fds[1], STDERR_FILENO));
     close(fds[1]);
 
-    std::string exe_name = android::base::GetExecutablePath();
-    args.insert(args.begin(), exe_name.c_str());
+    args.insert(args.begin(), exe_name_.c_str());
     args.push_back(nullptr);
     execv(args[0], reinterpret_cast<char* const*>(const_cast<char**>(args.data())));
     exit(1);
@@ -508,90 +518,1044 @@ TEST_F(SystemTests, verify_fail_color) {
       "\n"
       " 1 FAILED TEST\n";
   ASSERT_NO_FATAL_FAILURE(
-      Verify("*.DISABLED_fail", expected, 1,
-             std::vector<const char*>{"--gtest_color=yes", "--no_gtest_format"}));
+      Verify("*.DISABLED_fail", expected, 1,
+             std::vector<const char*>{"--gtest_color=yes", "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_fail_fast) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_all_pass_*:*.DISABLED_all_fail_*\n"
+      "[==========] Running 4 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTests.DISABLED_all_pass_1 (XX ms)\n"
+      "[    OK    ] SystemTests.DISABLED_all_pass_2 (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_all_fail_1 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_all_fail_1\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_all_fail_1 exited with exitcode 1.\n"
+      "Failure limit reached, no more tests are launched.\n"
+      "[==========] 4 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_all_fail_1\n"
+      "[  NOT RUN ] 1 test not run because of the failure limit, listed below:\n"
+      "[  NOT RUN ] SystemTests.DISABLED_all_fail_2\n"
+      "\n"
+      " 1 FAILED TEST\n"
+      " 1 NOT RUN TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_all_pass_*:*.DISABLED_all_fail_*", expected, 1,
+                                 std::vector<const char*>{"-j1", "--fail_fast",
+                                                          "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_fail_fast_kill) {
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  // The sleeping test is killed as soon as the other test fails.
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail:*.DISABLED_sleep5\n"
+      "[==========] Running 2 tests from 1 test suite (2 jobs).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "Failure limit reached, killing 1 running test.\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "[  NOT RUN ] 1 test not run because of the failure limit, listed below:\n"
+      "[  NOT RUN ] SystemTests.DISABLED_sleep5\n"
+      "\n"
+      " 1 FAILED TEST\n"
+      " 1 NOT RUN TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_fail:*.DISABLED_sleep5", expected, 1,
+                                 std::vector<const char*>{"-j2", "--fail_fast",
+                                                          "--kill_on_failure_limit",
+                                                          tmp_arg.c_str(), "--no_gtest_format"}));
+
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  EXPECT_NE(std::string::npos,
+            xml_output.find("    <testcase name=\"DISABLED_sleep5\" status=\"notrun\""))
+      << xml_output;
+  EXPECT_NE(std::string::npos,
+            xml_output.find("      <skipped message=\"Not run because of the failure limit\" />\n"))
+      << xml_output;
+}
+
+TEST_F(SystemTests, verify_max_failures) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail_*\n"
+      "[==========] Running 10 tests from 1 test suite (1 job).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_0 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail_0\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail_0 exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_1 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail_1\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail_1 exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_2 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail_2\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail_2 exited with exitcode 1.\n"
+      "Failure limit reached, no more tests are launched.\n"
+      "[==========] 10 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 3 tests, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_0\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_1\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_2\n"
+      "[  NOT RUN ] 7 tests not run because of the failure limit, listed below:\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_3\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_4\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_5\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_6\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_7\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_8\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_9\n"
+      "\n"
+      " 3 FAILED TESTS\n"
+      " 7 NOT RUN TESTS\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_fail_*", expected, 1,
+                                 std::vector<const char*>{"-j1", "--max_failures=2",
+                                                          "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_max_failure_ratio) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail_*\n"
+      "[==========] Running 10 tests from 1 test suite (1 job).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_0 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail_0\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail_0 exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_1 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail_1\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail_1 exited with exitcode 1.\n"
+      "Failure limit reached, no more tests are launched.\n"
+      "[==========] 10 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 2 tests, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_0\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail_1\n"
+      "[  NOT RUN ] 8 tests not run because of the failure limit, listed below:\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_2\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_3\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_4\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_5\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_6\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_7\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_8\n"
+      "[  NOT RUN ] SystemTests.DISABLED_fail_9\n"
+      "\n"
+      " 2 FAILED TESTS\n"
+      " 8 NOT RUN TESTS\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_fail_*", expected, 1,
+                                 std::vector<const char*>{"-j1", "--max_failure_ratio=0.1",
+                                                          "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_retry_failed_flaky) {
+  TemporaryDir dir;
+  std::string marker(std::string(dir.path) + "/flaky");
+  ASSERT_NE(-1, setenv("SYSTEM_TESTS_FLAKY_MARKER", marker.c_str(), 1));
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_flaky:*.DISABLED_pass\n"
+      "[==========] Running 2 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTests.DISABLED_pass (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_flaky (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_flaky\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_flaky exited with exitcode 1.\n"
+      "SystemTests.DISABLED_flaky will be run again (retry 1 of 2).\n"
+      "[    OK    ] SystemTests.DISABLED_flaky (XX ms)\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n"
+      "[  FLAKY   ] 1 test passed after failing, listed below:\n"
+      "[  FLAKY   ] SystemTests.DISABLED_flaky (passed on run 2)\n"
+      "\n"
+      " 1 FLAKY TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_flaky:*.DISABLED_pass", expected, 0,
+                                 std::vector<const char*>{"-j1", "--retry_failed=2",
+                                                          tmp_arg.c_str(), "--no_gtest_format"}));
+  unlink(marker.c_str());
+  ASSERT_NE(-1, unsetenv("SYSTEM_TESTS_FLAKY_MARKER"));
+
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  EXPECT_NE(std::string::npos,
+            xml_output.find("    <testcase name=\"DISABLED_flaky\" status=\"run\""))
+      << xml_output;
+  EXPECT_NE(std::string::npos, xml_output.find("      <flakyFailure message=\"")) << xml_output;
+  EXPECT_EQ(std::string::npos, xml_output.find("<failure")) << xml_output;
+}
+
+TEST_F(SystemTests, verify_retry_failed_fail) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "SystemTests.DISABLED_fail will be run again (retry 1 of 2).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "SystemTests.DISABLED_fail will be run again (retry 2 of 2).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_fail", expected, 1,
+             std::vector<const char*>{"--retry_failed=2", "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_output_capture_memfd) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_fail", expected, 1,
+             std::vector<const char*>{"--output_capture=memfd", "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_output_capture_memfd_skip) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_skip_with_message\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  SKIPPED ] SystemTests.DISABLED_skip_with_message (XX ms)\n"
+      "This is a skip message\n"
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  SKIPPED ] 1 test, listed below:\n"
+      "[  SKIPPED ] SystemTests.DISABLED_skip_with_message\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_skip_with_message", expected, 0,
+             std::vector<const char*>{"--output_capture=memfd", "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_spool_output) {
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  std::string output(std::string(4096, 'x') +
+                     "\n"
+                     "file:(XX) Failure in test SystemTests.DISABLED_large_output_fail\n"
+                     "Expected equality of these values:\n"
+                     "  1\n"
+                     "  0\n"
+                     "SystemTests.DISABLED_large_output_fail exited with exitcode 1.\n");
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_large_output_fail\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  FAILED  ] SystemTests.DISABLED_large_output_fail (XX ms)\n" +
+      output +
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_large_output_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_large_output_fail", expected, 1,
+                                 std::vector<const char*>{"--spool_threshold_kb=1",
+                                                          tmp_arg.c_str(), "--no_gtest_format"}));
+
+  // The xml file is written from the spool file.
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  raw_output_ = xml_output;
+  SanitizeOutput();
+  EXPECT_NE(std::string::npos, sanitized_output_.find("      <failure message=\"" + output + "\""))
+      << xml_output;
+}
+
+TEST_F(SystemTests, verify_compress_output) {
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  ASSERT_NO_FATAL_FAILURE(RunTest("*.DISABLED_large_output_fail",
+                                  std::vector<const char*>{"--compress_output", tmp_arg.c_str(),
+                                                           "--no_gtest_format"}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  std::regex regex(
+      "\\n\\[==========\\] Compressed (\\d+) bytes of output to (\\d+) bytes \\([\\d.]+x\\) "
+      "in \\d+ ms\\.\\n\\[  PASSED  \\] 0 tests\\.\\n");
+  std::smatch match;
+  ASSERT_TRUE(std::regex_search(sanitized_output_, match, regex)) << "Test output:\n"
+                                                                   << raw_output_;
+  EXPECT_GT(std::stoul(match[1]), 4096U);
+  EXPECT_LT(std::stoul(match[2]), 1024U);
+
+  // The xml file is written from the compressed output.
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  raw_output_ = xml_output;
+  SanitizeOutput();
+  EXPECT_NE(std::string::npos,
+            sanitized_output_.find(
+                "      <failure message=\"" + std::string(4096, 'x') +
+                "\n"
+                "file:(XX) Failure in test SystemTests.DISABLED_large_output_fail\n"
+                "Expected equality of these values:\n"
+                "  1\n"
+                "  0\n"
+                "SystemTests.DISABLED_large_output_fail exited with exitcode 1.\n\""))
+      << xml_output;
+}
+
+TEST_F(SystemTests, verify_dedupe_failures) {
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail:*.DISABLED_same_failure*\n"
+      "[==========] Running 3 tests from 1 test suite (1 job).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_same_failure1 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_same_failure1\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_same_failure1 exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_same_failure2 (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_same_failure2\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_same_failure2 exited with exitcode 1.\n"
+      "[==========] 3 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 3 tests, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "[  FAILED  ] SystemTests.DISABLED_same_failure1\n"
+      "[  FAILED  ] SystemTests.DISABLED_same_failure2\n"
+      "[  FAILED  ] 3 tests failed the same way as SystemTests.DISABLED_fail:\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "\n"
+      " 3 FAILED TESTS\n";
+  ASSERT_NO_FATAL_FAILURE(Verify(
+      "*.DISABLED_fail:*.DISABLED_same_failure*", expected, 1,
+      std::vector<const char*>{"-j1", "--dedupe_failures", tmp_arg.c_str(), "--no_gtest_format"}));
+
+  // The tests that share their output still have their own name in the xml.
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  EXPECT_NE(std::string::npos,
+            xml_output.find(") Failure in test SystemTests.DISABLED_same_failure2\n"
+                            "Expected equality of these values:\n"
+                            "  1\n"
+                            "  0\n"
+                            "SystemTests.DISABLED_same_failure2 exited with exitcode 1.\n\""))
+      << xml_output;
+}
+
+TEST_F(SystemTests, verify_keep_output) {
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  // The output is printed, but not kept for the xml file.
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_fail", expected, 1,
+                                 std::vector<const char*>{"--keep_output=none", tmp_arg.c_str(),
+                                                          "--no_gtest_format"}));
+
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  EXPECT_NE(std::string::npos, xml_output.find("      <failure message=\"\" type=\"\">\n"))
+      << xml_output;
+}
+
+TEST_F(SystemTests, verify_output_limit) {
+  ASSERT_NO_FATAL_FAILURE(RunTest("*.DISABLED_large_output_fail",
+                                  std::vector<const char*>{"--output_limit_kb=1",
+                                                           "--no_gtest_format"}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+
+  // Only the first and the last 1024 bytes of the output are kept, the size
+  // of the end depends on the length of the path in the failure message.
+  std::regex regex(
+      "\\[  FAILED  \\] SystemTests\\.DISABLED_large_output_fail \\(XX ms\\)\\n"
+      "x{1024}\\n\\.\\.\\. (\\d+) bytes of output dropped \\.\\.\\.\\n(x*)\\n"
+      "file:\\(XX\\) Failure in test SystemTests\\.DISABLED_large_output_fail\\n");
+  std::smatch match;
+  ASSERT_TRUE(std::regex_search(sanitized_output_, match, regex)) << "Test output:\n"
+                                                                   << raw_output_;
+  ASSERT_EQ(4096U - 1024 - match[2].length(), std::stoul(match[1])) << raw_output_;
+  ASSERT_GT(1024U, match[2].length());
+  ASSERT_NE(std::string::npos,
+            sanitized_output_.find(
+                "SystemTests.DISABLED_large_output_fail exited with exitcode 1.\n"));
+}
+
+TEST_F(SystemTests, verify_max_output_rate) {
+  ASSERT_NO_FATAL_FAILURE(RunTest(
+      "*.DISABLED_chatty",
+      std::vector<const char*>{"--max_output_rate_kb=1024", "--output_limit_kb=1"}));
+  ASSERT_EQ(0, exitcode_) << "Test output:\n" << raw_output_;
+
+  // One second worth of output is read right away, the rest takes three
+  // more seconds at the rate.
+  std::regex regex(
+      "\\nSystemTests\\.DISABLED_chatty wrote 4194304 bytes of output, reading it was paused "
+      "for (\\d+) ms to stay under 1024 KB per second\\.\\n");
+  std::smatch match;
+  ASSERT_TRUE(std::regex_search(raw_output_, match, regex)) << "Test output:\n" << raw_output_;
+  EXPECT_LE(2000U, std::stoul(match[1])) << raw_output_;
+}
+
+TEST_F(SystemTests, verify_output_dir) {
+  TemporaryDir td;
+  std::string dir_arg(std::string("--output_dir=") + td.path);
+
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_pass:*.DISABLED_fail\n"
+      "[==========] Running 2 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTests.DISABLED_pass (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 1 test.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_pass:*.DISABLED_fail", expected, 1,
+             std::vector<const char*>{"-j1", dir_arg.c_str(), "--no_gtest_format"}));
+
+  // The log files only have the output of the test itself.
+  std::string log;
+  ASSERT_TRUE(android::base::ReadFileToString(
+      std::string(td.path) + "/SystemTests/DISABLED_pass.1.log", &log));
+  EXPECT_EQ("", log);
+  ASSERT_TRUE(android::base::ReadFileToString(
+      std::string(td.path) + "/SystemTests/DISABLED_fail.1.log", &log));
+  raw_output_ = log;
+  SanitizeOutput();
+  EXPECT_EQ(
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n",
+      sanitized_output_);
+}
+
+TEST_F(SystemTests, verify_fail_gtest_format) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_fail\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[ RUN      ] SystemTests.DISABLED_fail\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_fail", expected, 1));
+}
+
+TEST_F(SystemTests, verify_fail_gtest_format_color) {
+  std::string expected =
+      "\x1B[0;33mNote: Google Test filter = *.DISABLED_fail\x1B[m\n"
+      "\x1B[0;32m[==========]\x1B[m Running 1 test from 1 test suite (20 jobs).\n"
+      "\x1B[0;32m[ RUN      ]\x1B[m SystemTests.DISABLED_fail\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "\x1B[0;31m[  FAILED  ]\x1B[m SystemTests.DISABLED_fail (XX ms)\n"
+      "\x1B[0;32m[==========]\x1B[m 1 test from 1 test suite ran. (XX ms total)\n"
+      "\x1B[0;32m[  PASSED  ]\x1B[m 0 tests.\n"
+      "\x1B[0;31m[  FAILED  ]\x1B[m 1 test, listed below:\n"
+      "\x1B[0;31m[  FAILED  ]\x1B[m SystemTests.DISABLED_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_fail", expected, 1, std::vector<const char*>{"--gtest_color=yes"}));
+}
+
+TEST_F(SystemTests, verify_deathtest_fail) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_death_fail\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  FAILED  ] SystemTestsDeathTest.DISABLED_death_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTestsDeathTest.DISABLED_death_fail\n"
+      "Death test: DeathTestHelperFail()\n"
+      "    Result: failed to die.\n"
+      " Error msg:\n"
+      "[  DEATH   ] \n"
+      "SystemTestsDeathTest.DISABLED_death_fail exited with exitcode 1.\n"
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTestsDeathTest.DISABLED_death_fail\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_death_fail", expected, 1, std::vector<const char*>{"--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_crash) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_crash\n"
+      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash (XX ms)\n"
+#if defined(__APPLE__)
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault: 11.\n"
+#else
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault.\n"
+#endif
+      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 0 tests.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_crash", expected, 1, std::vector<const char*>{"--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_batch) {
+  std::string expected =
+      "Note: Google Test filter = "
+      "*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_crash:*.DISABLED_order_3\n"
+      "[==========] Running 4 tests from 1 test suite (20 jobs).\n"
+      "[    OK    ] SystemTests.DISABLED_pass (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash (XX ms)\n"
+#if defined(__APPLE__)
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault: 11.\n"
+#else
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault.\n"
+#endif
+      "[    OK    ] SystemTests.DISABLED_order_3 (XX ms)\n"
+      "[==========] 4 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n"
+      "[  FAILED  ] 2 tests, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash\n"
+      "\n"
+      " 2 FAILED TESTS\n";
+  // All of the tests start in one process, the test after the crash runs in
+  // a new one.
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_crash:*.DISABLED_order_3", expected, 1,
+             std::vector<const char*>{"--batch_size=4", "--no_gtest_format"}));
+}
+
+#if defined(__linux__)
+TEST_F(SystemTests, verify_fork_server) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_pass:*.DISABLED_crash\n"
+      "[==========] Running 2 tests from 1 test suite (20 jobs).\n"
+      "[    OK    ] SystemTests.DISABLED_pass (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash (XX ms)\n"
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault.\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 1 test.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  // Both tests are in one batch so that the output order is fixed.
+  ASSERT_NO_FATAL_FAILURE(Verify(
+      "*.DISABLED_pass:*.DISABLED_crash", expected, 1,
+      std::vector<const char*>{"--fork_server", "--batch_size=2", "--no_gtest_format"}));
+}
+#endif
+
+TEST_F(SystemTests, verify_prefork) {
+  std::string expected =
+      "Note: Google Test filter = "
+      "*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_crash:*.DISABLED_order_3\n"
+      "[==========] Running 4 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTests.DISABLED_pass (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
+      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
+      "Expected equality of these values:\n"
+      "  1\n"
+      "  0\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash (XX ms)\n"
+#if defined(__APPLE__)
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault: 11.\n"
+#else
+      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault.\n"
+#endif
+      "[    OK    ] SystemTests.DISABLED_order_3 (XX ms)\n"
+      "[==========] 4 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n"
+      "[  FAILED  ] 2 tests, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_fail\n"
+      "[  FAILED  ] SystemTests.DISABLED_crash\n"
+      "\n"
+      " 2 FAILED TESTS\n";
+  // Every test after the first one runs in a preforked child.
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_crash:*.DISABLED_order_3", expected, 1,
+             std::vector<const char*>{"-j1", "--prefork=2", "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_test_durations) {
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "SystemTests.DISABLED_order_3 500\nSystemTests.DISABLED_pass 1\n", tf.path));
+  std::string durations_arg(std::string("--test_durations=") + tf.path);
+
+  // The longest test runs first.
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_pass:*.DISABLED_order_3\n"
+      "[==========] Running 2 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTests.DISABLED_order_3 (XX ms)\n"
+      "[    OK    ] SystemTests.DISABLED_pass (XX ms)\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n";
+  ASSERT_NO_FATAL_FAILURE(
+      Verify("*.DISABLED_pass:*.DISABLED_order_3", expected, 0,
+             std::vector<const char*>{"-j1", durations_arg.c_str(), "--no_gtest_format"}));
+
+  // The file now has the run times of this run.
+  std::string durations;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &durations));
+  ASSERT_TRUE(std::regex_match(
+      durations, std::regex("SystemTests.DISABLED_order_3 \\d+\nSystemTests.DISABLED_pass \\d+\n")))
+      << durations;
 }
 
-TEST_F(SystemTests, verify_fail_gtest_format) {
-  std::string expected =
-      "Note: Google Test filter = *.DISABLED_fail\n"
-      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
-      "[ RUN      ] SystemTests.DISABLED_fail\n"
+TEST_F(SystemTests, verify_timing_db) {
+  TemporaryDir td;
+  std::string db_file(std::string(td.path) + "/timing.db");
+  std::string db_arg("--timing_db=" + db_file);
+
+  std::string fail =
+      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
       "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
       "Expected equality of these values:\n"
       "  1\n"
       "  0\n"
-      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
-      "[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"
-      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
-      "[  PASSED  ] 0 tests.\n"
+      "SystemTests.DISABLED_fail exited with exitcode 1.\n";
+  std::string pass = "[    OK    ] SystemTests.DISABLED_order_2 (XX ms)\n";
+  for (uint32_t runs = 1; runs <= 2; runs++) {
+    // Once the database has the run times, the longest test starts first.
+    std::string expected =
+        "Note: Google Test filter = *.DISABLED_order_2:*.DISABLED_fail\n"
+        "[==========] Running 2 tests from 1 test suite (1 job).\n" +
+        (runs == 1 ? fail + pass : pass + fail) +
+        "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+        "[  PASSED  ] 1 test.\n"
+        "[  FAILED  ] 1 test, listed below:\n"
+        "[  FAILED  ] SystemTests.DISABLED_fail\n"
+        "\n"
+        " 1 FAILED TEST\n";
+    ASSERT_NO_FATAL_FAILURE(
+        Verify("*.DISABLED_order_2:*.DISABLED_fail", expected, 1,
+               std::vector<const char*>{"-j1", db_arg.c_str(), "--no_gtest_format"}));
+
+    // The child runner is this binary, so it uses the same records.
+    TimingDb db(db_file, TimingDb::GetBinaryId());
+    db.Load();
+    ASSERT_EQ(2U, db.record_count());
+    const TimingDb::Record* record = db.Find("SystemTests.DISABLED_order_2");
+    ASSERT_TRUE(record != nullptr);
+    EXPECT_EQ(runs, record->count);
+    EXPECT_EQ(TEST_PASS, record->result[runs - 1]);
+    EXPECT_LE(3000U, record->duration_ms[runs - 1]);
+    EXPECT_NE(0U, record->peak_rss_kb[runs - 1]);
+    record = db.Find("SystemTests.DISABLED_fail");
+    ASSERT_TRUE(record != nullptr);
+    EXPECT_EQ(runs, record->count);
+    EXPECT_EQ(TEST_FAIL, record->result[runs - 1]);
+  }
+  unlink((db_file + ".lock").c_str());
+  unlink(db_file.c_str());
+}
+
+// Writes a script that runs this binary, which the timing db tells apart
+// from it. With a delay, the listing of the tests stays open for that long
+// after all of them are listed.
+static void WriteWrapper(const std::string& path, int list_delay_s = 0) {
+  std::string exe(android::base::GetExecutablePath());
+  std::string script("#!/bin/sh\n");
+  if (list_delay_s != 0) {
+    script += android::base::StringPrintf(
+        "for arg in \"$@\"; do\n"
+        "  if [ \"$arg\" = --gtest_list_tests ]; then\n"
+        "    %s \"$@\"\n"
+        "    sleep %d\n"
+        "    exit\n"
+        "  fi\n"
+        "done\n",
+        exe.c_str(), list_delay_s);
+  }
+  script += "exec " + exe + " \"$@\"\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(script, path));
+  ASSERT_EQ(0, chmod(path.c_str(), 0755));
+}
+
+TEST_F(SystemTests, verify_runner_binaries) {
+  TemporaryDir td;
+  std::string wrapper(std::string(td.path) + "/wrapper");
+  ASSERT_NO_FATAL_FAILURE(WriteWrapper(wrapper));
+  std::string exe(android::base::GetExecutablePath());
+
+  UseRunner();
+  ASSERT_NO_FATAL_FAILURE(RunTest("*.DISABLED_pass:*.DISABLED_fail",
+                                  std::vector<const char*>{exe.c_str(), wrapper.c_str()}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  EXPECT_NE(std::string::npos,
+            sanitized_output_.find("[==========] Running 4 tests from 2 test suites in 2 binaries "
+                                   "(20 jobs).\n"))
+      << "Test output:\n" << raw_output_;
+  // Every binary gets its own footer, followed by the one of the whole run.
+  std::string binary_footer(
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 1 test.\n"
       "[  FAILED  ] 1 test, listed below:\n"
       "[  FAILED  ] SystemTests.DISABLED_fail\n"
       "\n"
-      " 1 FAILED TEST\n";
-  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_fail", expected, 1));
+      " 1 FAILED TEST\n");
+  size_t exe_footer = sanitized_output_.find("\n[==========] " + exe + "\n" + binary_footer);
+  ASSERT_NE(std::string::npos, exe_footer) << "Test output:\n" << raw_output_;
+  size_t wrapper_footer =
+      sanitized_output_.find("\n[==========] " + wrapper + "\n" + binary_footer, exe_footer);
+  ASSERT_NE(std::string::npos, wrapper_footer) << "Test output:\n" << raw_output_;
+  EXPECT_NE(std::string::npos,
+            sanitized_output_.find("[==========] 4 tests from 2 test suites ran. (XX ms total)\n",
+                                   wrapper_footer))
+      << "Test output:\n" << raw_output_;
+  unlink(wrapper.c_str());
+}
+
+TEST_F(SystemTests, verify_runner_xml) {
+  TemporaryDir td;
+  std::string xml_arg("--gtest_output=xml:" + std::string(td.path) + "/results.xml");
+  std::string exe(android::base::GetExecutablePath());
+
+  UseRunner();
+  ASSERT_NO_FATAL_FAILURE(RunTest(
+      "*.DISABLED_pass", std::vector<const char*>{exe.c_str(), exe.c_str(), xml_arg.c_str()}));
+  ASSERT_EQ(0, exitcode_) << "Test output:\n" << raw_output_;
+
+  // Every binary has its own file named after it, in the directory of the
+  // xml file, even when two of the binaries have the same name.
+  std::string name(android::base::Basename(exe));
+  for (const std::string& xml_name : {name + ".xml", name + "_1.xml"}) {
+    std::string xml;
+    ASSERT_TRUE(android::base::ReadFileToString(std::string(td.path) + '/' + xml_name, &xml))
+        << xml_name;
+    EXPECT_NE(std::string::npos, xml.find("<testsuites tests=\"1\" failures=\"0\""))
+        << xml_name << ":\n" << xml;
+    EXPECT_NE(std::string::npos, xml.find("<testcase name=\"DISABLED_pass\""))
+        << xml_name << ":\n" << xml;
+    unlink((std::string(td.path) + '/' + xml_name).c_str());
+  }
+  std::string xml;
+  EXPECT_FALSE(android::base::ReadFileToString(std::string(td.path) + "/results.xml", &xml));
 }
 
-TEST_F(SystemTests, verify_fail_gtest_format_color) {
-  std::string expected =
-      "\x1B[0;33mNote: Google Test filter = *.DISABLED_fail\x1B[m\n"
-      "\x1B[0;32m[==========]\x1B[m Running 1 test from 1 test suite (20 jobs).\n"
-      "\x1B[0;32m[ RUN      ]\x1B[m SystemTests.DISABLED_fail\n"
-      "file:(XX) Failure in test SystemTests.DISABLED_fail\n"
-      "Expected equality of these values:\n"
-      "  1\n"
-      "  0\n"
-      "SystemTests.DISABLED_fail exited with exitcode 1.\n"
-      "\x1B[0;31m[  FAILED  ]\x1B[m SystemTests.DISABLED_fail (XX ms)\n"
-      "\x1B[0;32m[==========]\x1B[m 1 test from 1 test suite ran. (XX ms total)\n"
-      "\x1B[0;32m[  PASSED  ]\x1B[m 0 tests.\n"
-      "\x1B[0;31m[  FAILED  ]\x1B[m 1 test, listed below:\n"
-      "\x1B[0;31m[  FAILED  ]\x1B[m SystemTests.DISABLED_fail\n"
-      "\n"
-      " 1 FAILED TEST\n";
+// Returns the message of the first failure in the xml file.
+static std::string XmlFailureMessage(const std::string& path) {
+  std::string xml;
+  EXPECT_TRUE(android::base::ReadFileToString(path, &xml)) << path;
+  std::smatch match;
+  EXPECT_TRUE(std::regex_search(xml, match, std::regex("<failure message=\"([^\"]*)\""))) << xml;
+  return match.empty() ? "" : match[1].str();
+}
+
+TEST_F(SystemTests, verify_runner_output) {
+  TemporaryDir td;
+  std::string xml_file(std::string(td.path) + "/results.xml");
+  std::string xml_arg("--gtest_output=xml:" + xml_file);
+  std::string exe(android::base::GetExecutablePath());
+
   ASSERT_NO_FATAL_FAILURE(
-      Verify("*.DISABLED_fail", expected, 1, std::vector<const char*>{"--gtest_color=yes"}));
+      RunTest("*.DISABLED_pass:*.DISABLED_fail",
+              std::vector<const char*>{"-j1", "--no_gtest_format", xml_arg.c_str()}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  std::string output(sanitized_output_);
+  std::string failure(XmlFailureMessage(xml_file));
+  ASSERT_NE("", failure);
+
+  // The tests run from the runner print exactly what they print when the
+  // binary runs them, only the footer has a line about the listing.
+  UseRunner();
+  ASSERT_NO_FATAL_FAILURE(
+      RunTest("*.DISABLED_pass:*.DISABLED_fail",
+              std::vector<const char*>{"-j1", "--no_gtest_format", xml_arg.c_str(), exe.c_str()}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  EXPECT_EQ(output, std::regex_replace(sanitized_output_,
+                                       std::regex("\\[==========\\] First test started .*\n"), ""));
+  EXPECT_EQ(failure, XmlFailureMessage(xml_file));
+  unlink(xml_file.c_str());
 }
 
-TEST_F(SystemTests, verify_deathtest_fail) {
-  std::string expected =
-      "Note: Google Test filter = *.DISABLED_death_fail\n"
-      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
-      "[  FAILED  ] SystemTestsDeathTest.DISABLED_death_fail (XX ms)\n"
-      "file:(XX) Failure in test SystemTestsDeathTest.DISABLED_death_fail\n"
-      "Death test: DeathTestHelperFail()\n"
-      "    Result: failed to die.\n"
-      " Error msg:\n"
-      "[  DEATH   ] \n"
-      "SystemTestsDeathTest.DISABLED_death_fail exited with exitcode 1.\n"
-      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
-      "[  PASSED  ] 0 tests.\n"
-      "[  FAILED  ] 1 test, listed below:\n"
-      "[  FAILED  ] SystemTestsDeathTest.DISABLED_death_fail\n"
-      "\n"
-      " 1 FAILED TEST\n";
+TEST_F(SystemTests, verify_runner_shared_jobs) {
+  std::string exe(android::base::GetExecutablePath());
+
+  // Each binary has a 3 second test, with one pool of two jobs they run at
+  // the same time.
+  UseRunner();
+  uint64_t time_ns = NanoTime();
   ASSERT_NO_FATAL_FAILURE(
-      Verify("*.DISABLED_death_fail", expected, 1, std::vector<const char*>{"--no_gtest_format"}));
+      RunTest("*.DISABLED_order_2", std::vector<const char*>{"-j2", exe.c_str(), exe.c_str()}));
+  time_ns = NanoTime() - time_ns;
+  ASSERT_EQ(0, exitcode_) << "Test output:\n" << raw_output_;
+  EXPECT_NE(std::string::npos,
+            sanitized_output_.find("[==========] Running 2 tests from 2 test suites in 2 binaries "
+                                   "(2 jobs).\n"))
+      << "Test output:\n" << raw_output_;
+  ASSERT_GT(5 * kNsPerS, time_ns) << "Test output:\n" << raw_output_;
+}
+
+TEST_F(SystemTests, verify_runner_timing_db) {
+  TemporaryDir td;
+  std::string db_file(std::string(td.path) + "/timing.db");
+  std::string db_arg("--timing_db=" + db_file);
+  std::string wrapper(std::string(td.path) + "/wrapper");
+  ASSERT_NO_FATAL_FAILURE(WriteWrapper(wrapper));
+  std::string exe(android::base::GetExecutablePath());
+
+  UseRunner();
+  ASSERT_NO_FATAL_FAILURE(RunTest(
+      "*.DISABLED_pass", std::vector<const char*>{db_arg.c_str(), exe.c_str(), wrapper.c_str()}));
+  ASSERT_EQ(0, exitcode_) << "Test output:\n" << raw_output_;
+
+  // The history of every binary is kept apart, and not under the runner.
+  TimingDb db(db_file, TimingDb::GetBinaryId());
+  db.Load();
+  EXPECT_EQ(2U, db.record_count());
+  const TimingDb::Record* record = db.Find("SystemTests.DISABLED_pass");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(1U, record->count);
+  record = db.Find(TimingDb::BinaryHash(TimingDb::GetBinaryId(wrapper)),
+                   "SystemTests.DISABLED_pass");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(1U, record->count);
+  EXPECT_TRUE(db.Find(TimingDb::BinaryHash(TimingDb::GetBinaryId(exe_name_)),
+                      "SystemTests.DISABLED_pass") == nullptr);
+  unlink((db_file + ".lock").c_str());
+  unlink(db_file.c_str());
+  unlink(wrapper.c_str());
+}
+
+// Runs the tests of a binary that is slow to finish listing them, so that
+// they run while the listing is still open.
+class SystemTestsStreaming : public SystemTests {
+ protected:
+  void SetUp() override {
+    SystemTests::SetUp();
+    wrapper_ = std::string(td_.path) + "/slow_listing";
+    ASSERT_NO_FATAL_FAILURE(WriteWrapper(wrapper_, 2));
+    UseRunner();
+  }
+
+  void TearDown() override { unlink(wrapper_.c_str()); }
+
+  void RunStreamed(const std::string& test_name, std::vector<const char*> extra_args = {}) {
+    extra_args.push_back(wrapper_.c_str());
+    ASSERT_NO_FATAL_FAILURE(RunTest(test_name, extra_args));
+  }
+
+  void VerifyCounts(size_t passed, size_t failed) {
+    std::string footer(android::base::StringPrintf("[  PASSED  ] %zu test%s.\n", passed,
+                                                   passed == 1 ? "" : "s"));
+    if (failed != 0) {
+      footer += android::base::StringPrintf("[  FAILED  ] %zu test%s, listed below:\n", failed,
+                                            failed == 1 ? "" : "s");
+    }
+    ASSERT_NE(std::string::npos, sanitized_output_.find(footer)) << "Test output:\n"
+                                                                 << raw_output_;
+    ASSERT_EQ(std::string::npos, sanitized_output_.find("terminated by signal"))
+        << "Test output:\n" << raw_output_;
+  }
+
+  TemporaryDir td_;
+  std::string wrapper_;
+};
+
+TEST_F(SystemTestsStreaming, verify_header_before_results) {
+  ASSERT_NO_FATAL_FAILURE(RunStreamed("*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_all_pass_1",
+                                      std::vector<const char*>{"--no_gtest_format"}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  ASSERT_NO_FATAL_FAILURE(VerifyCounts(2, 1));
+
+  // The results of the tests that finished while the listing was open are
+  // held until the header is printed.
+  size_t header =
+      sanitized_output_.find("[==========] Running 3 tests from 1 test suite (20 jobs).\n");
+  ASSERT_NE(std::string::npos, header) << "Test output:\n" << raw_output_;
+  size_t result = sanitized_output_.find("[    OK    ] ");
+  ASSERT_NE(std::string::npos, result) << "Test output:\n" << raw_output_;
+  ASSERT_LT(header, result) << "Test output:\n" << raw_output_;
+  ASSERT_LT(header, sanitized_output_.find("[  FAILED  ] SystemTests.DISABLED_fail (XX ms)\n"))
+      << "Test output:\n" << raw_output_;
+}
+
+TEST_F(SystemTestsStreaming, verify_first_test_started) {
+  ASSERT_NO_FATAL_FAILURE(RunStreamed("*.DISABLED_pass"));
+  ASSERT_EQ(0, exitcode_) << "Test output:\n" << raw_output_;
+  ASSERT_NO_FATAL_FAILURE(VerifyCounts(1, 0));
+
+  // The test started long before the listing finished.
+  std::smatch match;
+  ASSERT_TRUE(std::regex_search(
+      raw_output_, match,
+      std::regex("\\[==========\\] First test started after (\\d+) ms, all tests listed after "
+                 "(\\d+) ms\\.\n")))
+      << "Test output:\n" << raw_output_;
+  uint64_t started_ms = std::stoul(match[1]);
+  uint64_t listed_ms = std::stoul(match[2]);
+  ASSERT_LE(2000U, listed_ms) << "Test output:\n" << raw_output_;
+  ASSERT_GT(listed_ms - 1000, started_ms) << "Test output:\n" << raw_output_;
+}
+
+#if defined(__linux__)
+TEST_F(SystemTestsStreaming, verify_fork_server) {
+  // The fork server is only started once all of the tests are listed.
+  ASSERT_NO_FATAL_FAILURE(RunStreamed("*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_all_pass_1",
+                                      std::vector<const char*>{"--fork_server"}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  ASSERT_NO_FATAL_FAILURE(VerifyCounts(2, 1));
 }
 
-TEST_F(SystemTests, verify_crash) {
-  std::string expected =
-      "Note: Google Test filter = *.DISABLED_crash\n"
-      "[==========] Running 1 test from 1 test suite (20 jobs).\n"
-      "[  FAILED  ] SystemTests.DISABLED_crash (XX ms)\n"
-#if defined(__APPLE__)
-      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault: 11.\n"
-#else
-      "SystemTests.DISABLED_crash terminated by signal: Segmentation fault.\n"
+TEST_F(SystemTestsStreaming, verify_fork_server_listed) {
+  // Without a slow listing, the tests can all be listed before the first one
+  // is launched.
+  std::string exe(android::base::GetExecutablePath());
+  ASSERT_NO_FATAL_FAILURE(RunTest("*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_all_pass_1",
+                                  std::vector<const char*>{"--fork_server", exe.c_str()}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  ASSERT_NO_FATAL_FAILURE(VerifyCounts(2, 1));
+}
 #endif
-      "[==========] 1 test from 1 test suite ran. (XX ms total)\n"
-      "[  PASSED  ] 0 tests.\n"
-      "[  FAILED  ] 1 test, listed below:\n"
-      "[  FAILED  ] SystemTests.DISABLED_crash\n"
-      "\n"
-      " 1 FAILED TEST\n";
+
+TEST_F(SystemTestsStreaming, verify_prefork) {
+  // No child is preforked until all of the tests are listed.
   ASSERT_NO_FATAL_FAILURE(
-      Verify("*.DISABLED_crash", expected, 1, std::vector<const char*>{"--no_gtest_format"}));
+      RunStreamed("*.DISABLED_pass:*.DISABLED_fail:*.DISABLED_all_pass_1:*.DISABLED_all_pass_2",
+                  std::vector<const char*>{"-j1", "--prefork=2"}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  ASSERT_NO_FATAL_FAILURE(VerifyCounts(3, 1));
+}
+
+TEST_F(SystemTestsStreaming, verify_max_failure_ratio) {
+  // The ratio is only checked once the number of tests is known, one
+  // failure in four tests does not stop the run.
+  ASSERT_NO_FATAL_FAILURE(
+      RunStreamed("*.DISABLED_fail:*.DISABLED_pass:*.DISABLED_all_pass_1:*.DISABLED_all_pass_2",
+                  std::vector<const char*>{"--max_failure_ratio=0.5"}));
+  ASSERT_EQ(1, exitcode_) << "Test output:\n" << raw_output_;
+  ASSERT_NO_FATAL_FAILURE(VerifyCounts(3, 1));
+  ASSERT_EQ(std::string::npos, sanitized_output_.find("Failure limit reached"))
+      << "Test output:\n" << raw_output_;
 }
 
 TEST_F(SystemTests, verify_warning_slow) {
@@ -699,6 +1663,98 @@ TEST_F(SystemTests, verify_order_isolated) {
       Verify("*.DISABLED_order_*", expected, 0, std::vector<const char*>{"--no_gtest_format"}));
 }
 
+#if defined(__linux__)
+TEST_F(SystemTests, verify_memory_low) {
+  // With no memory to spare, the tests run one at a time.
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_order_*\n"
+      "[==========] Running 3 tests from 1 test suite (20 jobs).\n"
+      "[    OK    ] SystemTests.DISABLED_order_1 (XX ms)\n"
+      "[    OK    ] SystemTests.DISABLED_order_2 (XX ms)\n"
+      "[    OK    ] SystemTests.DISABLED_order_3 (XX ms)\n"
+      "[==========] 3 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 3 tests.\n";
+  ASSERT_NO_FATAL_FAILURE(Verify(
+      "*.DISABLED_order_*", expected, 0,
+      std::vector<const char*>{"--min_available_memory_mb=1000000000", "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_oom_killed_rerun) {
+  TemporaryDir dir;
+  std::string marker(std::string(dir.path) + "/oom");
+  std::string oom_kill_file(std::string(dir.path) + "/memory.events");
+  ASSERT_TRUE(android::base::WriteStringToFile("oom_kill 0\n", oom_kill_file));
+  ASSERT_NE(-1, setenv("SYSTEM_TESTS_FLAKY_MARKER", marker.c_str(), 1));
+  ASSERT_NE(-1, setenv("SYSTEM_TESTS_OOM_KILL_FILE", oom_kill_file.c_str(), 1));
+  std::string oom_kill_arg("--oom_kill_file=" + oom_kill_file);
+
+  // The OOM kill is counted while the test runs, it runs again once it can
+  // run by itself.
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_oom_once:*.DISABLED_order_2\n"
+      "[==========] Running 2 tests from 1 test suite (2 jobs).\n"
+      "SystemTests.DISABLED_oom_once killed by the OOM killer, running it again with at most 1 "
+      "job.\n"
+      "[    OK    ] SystemTests.DISABLED_order_2 (XX ms)\n"
+      "[    OK    ] SystemTests.DISABLED_oom_once (XX ms)\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n"
+      "[  OOM     ] 1 test killed by the OOM killer, listed below:\n"
+      "[  OOM     ] SystemTests.DISABLED_oom_once\n"
+      "\n"
+      " 1 OOM KILLED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_oom_once:*.DISABLED_order_2", expected, 0,
+                                 std::vector<const char*>{"-j2", "--min_available_memory_mb=1",
+                                                          oom_kill_arg.c_str(),
+                                                          "--no_gtest_format"}));
+  unlink(marker.c_str());
+  unlink(oom_kill_file.c_str());
+  ASSERT_NE(-1, unsetenv("SYSTEM_TESTS_FLAKY_MARKER"));
+  ASSERT_NE(-1, unsetenv("SYSTEM_TESTS_OOM_KILL_FILE"));
+}
+
+TEST_F(SystemTests, verify_oom_kill_not_claimed) {
+  TemporaryDir dir;
+  std::string oom_kill_file(std::string(dir.path) + "/memory.events");
+  ASSERT_TRUE(android::base::WriteStringToFile("oom_kill 0\n", oom_kill_file));
+  ASSERT_NE(-1, setenv("SYSTEM_TESTS_OOM_KILL_FILE", oom_kill_file.c_str(), 1));
+  std::string oom_kill_arg("--oom_kill_file=" + oom_kill_file);
+
+  // A test that kills itself fails, an OOM kill counted before it started
+  // is not attributed to it.
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_oom_elsewhere:*.DISABLED_kill_self\n"
+      "[==========] Running 2 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTests.DISABLED_oom_elsewhere (XX ms)\n"
+      "[  FAILED  ] SystemTests.DISABLED_kill_self (XX ms)\n"
+      "SystemTests.DISABLED_kill_self terminated by signal: Killed.\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 1 test.\n"
+      "[  FAILED  ] 1 test, listed below:\n"
+      "[  FAILED  ] SystemTests.DISABLED_kill_self\n"
+      "\n"
+      " 1 FAILED TEST\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_oom_elsewhere:*.DISABLED_kill_self", expected, 1,
+                                 std::vector<const char*>{"-j1", "--min_available_memory_mb=1",
+                                                          oom_kill_arg.c_str(),
+                                                          "--no_gtest_format"}));
+  unlink(oom_kill_file.c_str());
+  ASSERT_NE(-1, unsetenv("SYSTEM_TESTS_OOM_KILL_FILE"));
+}
+#endif
+
+TEST_F(SystemTests, verify_negative_filter) {
+  std::string expected =
+      "Note: Google Test filter = *.DISABLED_order_*-*_2:*_4\n"
+      "[==========] Running 2 tests from 1 test suite (20 jobs).\n"
+      "[    OK    ] SystemTests.DISABLED_order_3 (XX ms)\n"
+      "[    OK    ] SystemTests.DISABLED_order_1 (XX ms)\n"
+      "[==========] 2 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("*.DISABLED_order_*-*_2:*_4", expected, 0,
+                                 std::vector<const char*>{"--no_gtest_format"}));
+}
+
 TEST_F(SystemTests, verify_order_not_isolated) {
   std::string expected =
       "Note: Google Test filter = *.DISABLED_order_*\n"
@@ -1074,6 +2130,51 @@ TEST_F(SystemTests, verify_SIGINT) {
   ASSERT_EQ(1, WEXITSTATUS(status));
 }
 
+TEST_F(SystemTests, verify_SIGINT_xml) {
+  // Verify that the xml file has the tests that finished before SIGINT.
+  std::string tmp_arg("--gtest_output=xml:");
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  tmp_arg += tf.path;
+
+  Exec(std::vector<const char*>{"--gtest_filter=*.DISABLED_pass:*.DISABLED_job*",
+                                "--gtest_also_run_disabled_tests", "-j20", tmp_arg.c_str()});
+  // It is expected that only the passing test completes by the time the
+  // signal is sent.
+  sleep(1);
+  ASSERT_NE(-1, kill(pid_, SIGINT));
+
+  std::vector<char> buffer(4096);
+  while (true) {
+    ssize_t bytes = TEMP_FAILURE_RETRY(read(fd_, buffer.data(), buffer.size()));
+    if (bytes == -1 && errno == EAGAIN) {
+      continue;
+    }
+    ASSERT_NE(-1, bytes);
+    if (bytes == 0) {
+      break;
+    }
+  }
+  close(fd_);
+  int status;
+  ASSERT_EQ(pid_, TEMP_FAILURE_RETRY(waitpid(pid_, &status, 0)));
+  ASSERT_EQ(1, WEXITSTATUS(status));
+
+  std::string xml_output;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &xml_output));
+  std::regex regex(
+      "^<\\?xml version=\"1\\.0\" encoding=\"UTF-8\"\\?>\\n"
+      "<testsuites timestamp=\"[^\"]*\" name=\"AllTests\">\\n"
+      "  <testsuite name=\"SystemTests\" tests=\"1\" failures=\"0\" disabled=\"0\" "
+      "errors=\"0\" time=\"[\\d.]+\">\\n"
+      "    <testcase name=\"DISABLED_pass\" status=\"run\" time=\"[\\d.]+\" "
+      "classname=\"SystemTests\" />\\n"
+      "  </testsuite>\\n"
+      "</testsuites>\\n$");
+  ASSERT_TRUE(std::regex_search(xml_output, regex)) << xml_output;
+}
+
 TEST_F(SystemTests, verify_SIGQUIT) {
   // Verify that SIGQUIT prints all of the running tests.
   Exec(std::vector<const char*>{"--gtest_filter=*.DISABLED_job*", "--gtest_also_run_disabled_tests",
@@ -1258,6 +2359,124 @@ TEST_F(SystemTests, verify_sharding) {
                                  std::vector<const char*>{"--no_gtest_format"}));
 }
 
+TEST_F(SystemTests, verify_sharding_balanced) {
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  close(tf.fd);
+  std::string durations;
+  for (size_t suite = 1; suite <= 3; suite++) {
+    for (size_t test = 1; test <= 4; test++) {
+      int duration_ms = suite == 1 && test == 1 ? 3000 : 1000;
+      durations += android::base::StringPrintf("SystemTestsShard%zu.DISABLED_case%zu_test%zu %d\n",
+                                               suite, suite, test, duration_ms);
+    }
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(durations, tf.path));
+  std::string durations_arg(std::string("--shard_durations=") + tf.path);
+
+  // The longest test gets a shard almost to itself.
+  std::string expected =
+      "Note: Google Test filter = SystemTestsShard*.DISABLED*\n"
+      "Note: This is test shard 1 of 4\n"
+      "Note: Shard 1 of 4 has 2 tests, estimated 4000 ms\n"
+      "Note: Shard 2 of 4 has 4 tests, estimated 4000 ms\n"
+      "Note: Shard 3 of 4 has 3 tests, estimated 3000 ms\n"
+      "Note: Shard 4 of 4 has 3 tests, estimated 3000 ms\n"
+      "[==========] Running 2 tests from 2 test suites (1 job).\n"
+      "[    OK    ] SystemTestsShard1.DISABLED_case1_test1 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test3 (XX ms)\n"
+      "[==========] 2 tests from 2 test suites ran. (XX ms total)\n"
+      "[  PASSED  ] 2 tests.\n";
+  ASSERT_NE(-1, setenv("GTEST_TOTAL_SHARDS", "4", 1));
+  ASSERT_NE(-1, setenv("GTEST_SHARD_INDEX", "0", 1));
+  ASSERT_NO_FATAL_FAILURE(Verify("SystemTestsShard*.DISABLED*", expected, 0,
+                                 std::vector<const char*>{"-j1", "--sharding=balanced",
+                                                          durations_arg.c_str(),
+                                                          "--no_gtest_format"}));
+
+  expected =
+      "Note: Google Test filter = SystemTestsShard*.DISABLED*\n"
+      "Note: This is test shard 2 of 4\n"
+      "Note: Shard 1 of 4 has 2 tests, estimated 4000 ms\n"
+      "Note: Shard 2 of 4 has 4 tests, estimated 4000 ms\n"
+      "Note: Shard 3 of 4 has 3 tests, estimated 3000 ms\n"
+      "Note: Shard 4 of 4 has 3 tests, estimated 3000 ms\n"
+      "[==========] Running 4 tests from 3 test suites (1 job).\n"
+      "[    OK    ] SystemTestsShard1.DISABLED_case1_test2 (XX ms)\n"
+      "[    OK    ] SystemTestsShard2.DISABLED_case2_test1 (XX ms)\n"
+      "[    OK    ] SystemTestsShard2.DISABLED_case2_test4 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test4 (XX ms)\n"
+      "[==========] 4 tests from 3 test suites ran. (XX ms total)\n"
+      "[  PASSED  ] 4 tests.\n";
+  ASSERT_NE(-1, setenv("GTEST_SHARD_INDEX", "1", 1));
+  ASSERT_NO_FATAL_FAILURE(Verify("SystemTestsShard*.DISABLED*", expected, 0,
+                                 std::vector<const char*>{"-j1", "--sharding=balanced",
+                                                          durations_arg.c_str(),
+                                                          "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_sharding_hash) {
+  std::string expected =
+      "Note: Google Test filter = SystemTestsShard*.DISABLED*\n"
+      "Note: This is test shard 3 of 4\n"
+      "Note: Shard 1 of 4 has 1 test, estimated 0 ms\n"
+      "Note: Shard 2 of 4 has 5 tests, estimated 0 ms\n"
+      "Note: Shard 3 of 4 has 3 tests, estimated 0 ms\n"
+      "Note: Shard 4 of 4 has 3 tests, estimated 0 ms\n"
+      "[==========] Running 3 tests from 3 test suites (1 job).\n"
+      "[    OK    ] SystemTestsShard1.DISABLED_case1_test3 (XX ms)\n"
+      "[    OK    ] SystemTestsShard2.DISABLED_case2_test2 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test3 (XX ms)\n"
+      "[==========] 3 tests from 3 test suites ran. (XX ms total)\n"
+      "[  PASSED  ] 3 tests.\n";
+  ASSERT_NE(-1, setenv("GTEST_TOTAL_SHARDS", "4", 1));
+  ASSERT_NE(-1, setenv("GTEST_SHARD_INDEX", "2", 1));
+  ASSERT_NO_FATAL_FAILURE(Verify("SystemTestsShard*.DISABLED*", expected, 0,
+                                 std::vector<const char*>{"-j1", "--sharding=hash",
+                                                          "--no_gtest_format"}));
+
+  // Removing tests from other shards does not move any test.
+  expected =
+      "Note: Google Test filter = SystemTestsShard*.DISABLED*:-*case1_test1:*case2_test1\n"
+      "Note: This is test shard 3 of 4\n"
+      "Note: Shard 1 of 4 has 1 test, estimated 0 ms\n"
+      "Note: Shard 2 of 4 has 4 tests, estimated 0 ms\n"
+      "Note: Shard 3 of 4 has 3 tests, estimated 0 ms\n"
+      "Note: Shard 4 of 4 has 2 tests, estimated 0 ms\n"
+      "[==========] Running 3 tests from 3 test suites (1 job).\n"
+      "[    OK    ] SystemTestsShard1.DISABLED_case1_test3 (XX ms)\n"
+      "[    OK    ] SystemTestsShard2.DISABLED_case2_test2 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test3 (XX ms)\n"
+      "[==========] 3 tests from 3 test suites ran. (XX ms total)\n"
+      "[  PASSED  ] 3 tests.\n";
+  ASSERT_NO_FATAL_FAILURE(Verify("SystemTestsShard*.DISABLED*:-*case1_test1:*case2_test1",
+                                 expected, 0,
+                                 std::vector<const char*>{"-j1", "--sharding=hash",
+                                                          "--no_gtest_format"}));
+}
+
+TEST_F(SystemTests, verify_sharding_hash_suite) {
+  std::string expected =
+      "Note: Google Test filter = SystemTestsShard*.DISABLED*\n"
+      "Note: This is test shard 1 of 4\n"
+      "Note: Shard 1 of 4 has 4 tests, estimated 0 ms\n"
+      "Note: Shard 2 of 4 has 0 tests, estimated 0 ms\n"
+      "Note: Shard 3 of 4 has 0 tests, estimated 0 ms\n"
+      "Note: Shard 4 of 4 has 8 tests, estimated 0 ms\n"
+      "[==========] Running 4 tests from 1 test suite (1 job).\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test1 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test2 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test3 (XX ms)\n"
+      "[    OK    ] SystemTestsShard3.DISABLED_case3_test4 (XX ms)\n"
+      "[==========] 4 tests from 1 test suite ran. (XX ms total)\n"
+      "[  PASSED  ] 4 tests.\n";
+  ASSERT_NE(-1, setenv("GTEST_TOTAL_SHARDS", "4", 1));
+  ASSERT_NE(-1, setenv("GTEST_SHARD_INDEX", "0", 1));
+  ASSERT_NO_FATAL_FAILURE(Verify("SystemTestsShard*.DISABLED*", expected, 0,
+                                 std::vector<const char*>{"-j1", "--sharding=hash_suite",
+                                                          "--no_gtest_format"}));
+}
+
 TEST_F(SystemTests, verify_sharding_color) {
   std::string expected =
       "\x1B[0;33mNote: Google Test filter = SystemTestsShard*.DISABLED*\x1B[m\n"
@@ -1307,6 +2526,73 @@ TEST_F(SystemTests, DISABLED_fail) {
   ASSERT_EQ(1, 0);
 }
 
+// Fails the first time it runs, using a file to remember that it ran.
+TEST_F(SystemTests, DISABLED_flaky) {
+  const char* marker = getenv("SYSTEM_TESTS_FLAKY_MARKER");
+  ASSERT_TRUE(marker != nullptr);
+  if (access(marker, F_OK) == -1) {
+    ASSERT_TRUE(android::base::WriteStringToFile("", marker));
+    ASSERT_EQ(1, 0);
+  }
+}
+
+// Counts one more OOM kill in the file the runner reads them from.
+static void CountOomKill() {
+  const char* file = getenv("SYSTEM_TESTS_OOM_KILL_FILE");
+  ASSERT_TRUE(file != nullptr);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(file, &content));
+  uint64_t count;
+  ASSERT_EQ(1, sscanf(content.c_str(), "oom_kill %" SCNu64, &count));
+  std::string new_content("oom_kill " + std::to_string(count + 1) + "\n");
+  ASSERT_TRUE(android::base::WriteStringToFile(new_content, file));
+}
+
+// Killed the way the OOM killer kills, the first time it runs.
+TEST_F(SystemTests, DISABLED_oom_once) {
+  const char* marker = getenv("SYSTEM_TESTS_FLAKY_MARKER");
+  ASSERT_TRUE(marker != nullptr);
+  if (access(marker, F_OK) == -1) {
+    ASSERT_TRUE(android::base::WriteStringToFile("", marker));
+    ASSERT_NO_FATAL_FAILURE(CountOomKill());
+    raise(SIGKILL);
+  }
+}
+
+// An OOM kill of some other process.
+TEST_F(SystemTests, DISABLED_oom_elsewhere) {
+  ASSERT_NO_FATAL_FAILURE(CountOomKill());
+}
+
+TEST_F(SystemTests, DISABLED_kill_self) {
+  raise(SIGKILL);
+}
+
+TEST_F(SystemTests, DISABLED_large_output_fail) {
+  printf("%s\n", std::string(4096, 'x').c_str());
+  ASSERT_EQ(1, 0);
+}
+
+static void FailTheSameWay() {
+  ASSERT_EQ(1, 0);
+}
+
+TEST_F(SystemTests, DISABLED_same_failure1) {
+  FailTheSameWay();
+}
+
+TEST_F(SystemTests, DISABLED_same_failure2) {
+  FailTheSameWay();
+}
+
+TEST_F(SystemTests, DISABLED_chatty) {
+  // 4 MB of output.
+  std::string line(std::string(1023, 'x') + "\n");
+  for (size_t i = 0; i < 4096; i++) {
+    fputs(line.c_str(), stdout);
+  }
+}
+
 TEST_F(SystemTests, DISABLED_crash) {
   char* p = reinterpret_cast<char*>(static_cast<intptr_t>(atoi("0")));
   *p = 3;
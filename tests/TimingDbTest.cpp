@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "TimingDb.h"
+
+namespace android {
+namespace gtest_extras {
+
+class TimingDbTest : public ::testing::Test {
+ protected:
+  // Write leaves a lock file next to the database.
+  void TearDown() override { unlink((std::string(tf_.path) + ".lock").c_str()); }
+
+  TemporaryFile tf_;
+};
+
+TEST_F(TimingDbTest, missing_file) {
+  TemporaryDir dir;
+  TimingDb db(std::string(dir.path) + "/timing.db", "binary");
+  db.Load();
+  EXPECT_EQ(0U, db.record_count());
+  EXPECT_TRUE(db.Find("Suite.test") == nullptr);
+}
+
+TEST_F(TimingDbTest, invalid_file) {
+  ASSERT_TRUE(android::base::WriteStringToFile("Not a timing database.", tf_.path));
+  TimingDb db(tf_.path, "binary");
+  db.Load();
+  EXPECT_EQ(0U, db.record_count());
+
+  // The invalid file is replaced on the next write.
+  db.Add("Suite.test", 10, TEST_PASS, 100);
+  ASSERT_TRUE(db.Write());
+  EXPECT_EQ(1U, db.record_count());
+}
+
+TEST_F(TimingDbTest, round_trip) {
+  {
+    TimingDb db(tf_.path, "binary");
+    db.Load();
+    db.Add("Suite.test1", 10, TEST_PASS, 100);
+    db.Add("Suite.test2", 20, TEST_FAIL, 200);
+    ASSERT_TRUE(db.Write());
+  }
+
+  TimingDb db(tf_.path, "binary");
+  db.Load();
+  ASSERT_EQ(2U, db.record_count());
+
+  const TimingDb::Record* record = db.Find("Suite.test1");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(1U, record->count);
+  EXPECT_EQ(10U, record->duration_ms[0]);
+  EXPECT_EQ(100U, record->peak_rss_kb[0]);
+  EXPECT_EQ(TEST_PASS, record->result[0]);
+
+  record = db.Find("Suite.test2");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(1U, record->count);
+  EXPECT_EQ(20U, record->duration_ms[0]);
+  EXPECT_EQ(200U, record->peak_rss_kb[0]);
+  EXPECT_EQ(TEST_FAIL, record->result[0]);
+
+  EXPECT_TRUE(db.Find("Suite.test3") == nullptr);
+}
+
+TEST_F(TimingDbTest, rolling_window) {
+  TimingDb db(tf_.path, "binary");
+  db.Load();
+  for (size_t i = 1; i <= TimingDb::kWindowSize + 2; i++) {
+    db.Add("Suite.test", i * 10, TEST_PASS, 0);
+    ASSERT_TRUE(db.Write());
+  }
+
+  const TimingDb::Record* record = db.Find("Suite.test");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(TimingDb::kWindowSize, record->count);
+  // The two oldest samples were replaced.
+  EXPECT_EQ(90U, record->duration_ms[0]);
+  EXPECT_EQ(100U, record->duration_ms[1]);
+  EXPECT_EQ(30U, record->duration_ms[2]);
+  EXPECT_EQ(2U, record->next);
+  // Average of 30 to 100.
+  EXPECT_EQ(65U, TimingDb::AverageDurationMs(*record));
+}
+
+TEST_F(TimingDbTest, samples_in_one_write) {
+  TimingDb db(tf_.path, "binary");
+  db.Load();
+  db.Add("Suite.test", 10, TEST_PASS, 0);
+  db.Add("Suite.test", 20, TEST_PASS, 0);
+  db.Add("Suite.test", 60, TEST_TIMEOUT, 0);
+  ASSERT_TRUE(db.Write());
+
+  ASSERT_EQ(1U, db.record_count());
+  const TimingDb::Record* record = db.Find("Suite.test");
+  ASSERT_TRUE(record != nullptr);
+  ASSERT_EQ(3U, record->count);
+  EXPECT_EQ(10U, record->duration_ms[0]);
+  EXPECT_EQ(20U, record->duration_ms[1]);
+  EXPECT_EQ(60U, record->duration_ms[2]);
+  EXPECT_EQ(TEST_TIMEOUT, record->result[2]);
+  EXPECT_EQ(30U, TimingDb::AverageDurationMs(*record));
+}
+
+TEST_F(TimingDbTest, multiple_binaries) {
+  TimingDb db1(tf_.path, "binary1");
+  db1.Load();
+  db1.Add("Suite.test", 10, TEST_PASS, 0);
+  ASSERT_TRUE(db1.Write());
+
+  // A second binary with its own stale view of the file does not drop the
+  // records of the first one.
+  TimingDb db2(tf_.path, "binary2");
+  db2.Add("Suite.test", 500, TEST_PASS, 0);
+  ASSERT_TRUE(db2.Write());
+  EXPECT_EQ(2U, db2.record_count());
+
+  const TimingDb::Record* record = db2.Find("Suite.test");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(500U, record->duration_ms[0]);
+
+  db1.Load();
+  record = db1.Find("Suite.test");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(10U, record->duration_ms[0]);
+}
+
+TEST_F(TimingDbTest, binary_id) {
+  std::string id(TimingDb::GetBinaryId());
+  EXPECT_FALSE(id.empty());
+  EXPECT_EQ(id, TimingDb::GetBinaryId());
+}
+
+TEST_F(TimingDbTest, binary_id_from_path) {
+  // The running executable gets the same id from its file.
+  EXPECT_EQ(TimingDb::GetBinaryId(), TimingDb::GetBinaryId(android::base::GetExecutablePath()));
+
+  // Files that are not executables are told apart by their path.
+  TemporaryFile script;
+  ASSERT_TRUE(android::base::WriteStringToFile("#!/bin/sh\n", script.path));
+  std::string id(TimingDb::GetBinaryId(script.path));
+  EXPECT_EQ(0U, id.find(std::string(script.path) + ':'));
+  EXPECT_EQ(id, TimingDb::GetBinaryId(script.path));
+  EXPECT_EQ("/does/not/exist", TimingDb::GetBinaryId("/does/not/exist"));
+}
+
+TEST_F(TimingDbTest, binary_hash) {
+  TimingDb db(tf_.path, "binary1");
+  db.Add(TimingDb::BinaryHash("binary2"), "Suite.test", 10, TEST_PASS, 0);
+  ASSERT_TRUE(db.Write());
+  EXPECT_TRUE(db.Find("Suite.test") == nullptr);
+  const TimingDb::Record* record = db.Find(TimingDb::BinaryHash("binary2"), "Suite.test");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(10U, record->duration_ms[0]);
+
+  TimingDb db2(tf_.path, "binary2");
+  db2.Load();
+  record = db2.Find("Suite.test");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(10U, record->duration_ms[0]);
+}
+
+}  // namespace gtest_extras
+}  // namespace android
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "XmlWriter.h"
+
+namespace android {
+namespace gtest_extras {
+
+static std::string ReadFile(const std::string& path) {
+  std::string data;
+  EXPECT_TRUE(android::base::ReadFileToString(path, &data));
+  return data;
+}
+
+TEST(XmlWriterTest, escape) {
+  EXPECT_EQ("", XmlEscape(""));
+  EXPECT_EQ("no special characters", XmlEscape("no special characters"));
+  EXPECT_EQ("&lt;a b=&quot;c&apos;d&quot;&gt; &amp;&amp; x", XmlEscape("<a b=\"c'd\"> && x"));
+  EXPECT_EQ("&lt;&gt;", XmlEscape("<>"));
+}
+
+TEST(XmlWriterTest, escape_appends) {
+  std::string out("start ");
+  std::string data("a<b\0c", 5);
+  XmlEscape(data.data(), data.size(), &out);
+  EXPECT_EQ(std::string("start a&lt;b\0c", 14), out);
+}
+
+TEST(XmlWriterTest, trailer_after_every_write) {
+  TemporaryDir td;
+  std::string path(std::string(td.path) + "/results.xml");
+  XmlWriter writer;
+  ASSERT_TRUE(writer.Open(path, "</all>\n"));
+  writer.Append("<all>\n");
+  writer.Flush();
+  EXPECT_EQ("<all>\n</all>\n", ReadFile(path));
+
+  // Records are kept in the buffer until they are due.
+  writer.Append("  <one />\n");
+  writer.EndRecord(1);
+  EXPECT_EQ("<all>\n</all>\n", ReadFile(path));
+  EXPECT_EQ(1 + kXmlFlushIntervalNs, writer.flush_ns());
+  writer.Append("  <two />\n");
+  writer.EndRecord(1 + kXmlFlushIntervalNs);
+  EXPECT_EQ("<all>\n  <one />\n  <two />\n</all>\n", ReadFile(path));
+  EXPECT_EQ(UINT64_MAX, writer.flush_ns());
+
+  writer.Append("  <three />\n");
+  writer.Close();
+  EXPECT_EQ("<all>\n  <one />\n  <two />\n  <three />\n</all>\n", ReadFile(path));
+}
+
+TEST(XmlWriterTest, large_record) {
+  TemporaryDir td;
+  std::string path(std::string(td.path) + "/results.xml");
+  XmlWriter writer;
+  ASSERT_TRUE(writer.Open(path, "</all>\n"));
+  writer.Append("<all>\n");
+  std::string data(2 * kXmlBufferSize + 10, '<');
+  writer.AppendEscaped(data.data(), data.size());
+  EXPECT_EQ(static_cast<off_t>(6 + 4 * data.size()), writer.offset());
+  // The record was written as it went, it is completed as soon as it ends.
+  writer.EndRecord(1);
+  EXPECT_EQ(UINT64_MAX, writer.flush_ns());
+
+  std::string expected("<all>\n");
+  for (size_t i = 0; i < data.size(); i++) {
+    expected += "&lt;";
+  }
+  EXPECT_EQ(expected + "</all>\n", ReadFile(path));
+}
+
+TEST(XmlWriterTest, append_range) {
+  TemporaryDir td;
+  std::string from_path(std::string(td.path) + "/from.xml");
+  XmlWriter from;
+  ASSERT_TRUE(from.Open(from_path, "</all>\n"));
+  from.Append("<all>\n");
+  off_t begin = from.offset();
+  std::string data;
+  for (size_t i = 0; data.size() < kXmlBufferSize + 100; i++) {
+    data += "  <test index=\"" + std::to_string(i) + "\" />\n";
+  }
+  from.Append(data);
+  off_t end = from.offset();
+  from.Flush();
+
+  std::string path(std::string(td.path) + "/results.xml");
+  XmlWriter writer;
+  ASSERT_TRUE(writer.Open(path, ""));
+  writer.Append("<grouped>\n");
+  writer.AppendRange(from.fd(), begin, end);
+  writer.Append("</grouped>\n");
+  writer.Close();
+  EXPECT_EQ("<grouped>\n" + data + "</grouped>\n", ReadFile(path));
+}
+
+TEST(XmlWriterTest, open_fails) {
+  XmlWriter writer;
+  ASSERT_FALSE(writer.Open("/does/not/exist/results.xml", ""));
+}
+
+}  // namespace gtest_extras
+}  // namespace android